@@ -1,1177 +1,8180 @@
-/*
- * Copyright (C) Simon Lee@Huawei Tech.
- */
-
-#include <ngx_config.h>
-#include <ngx_core.h>
-#include <ngx_http.h>
-
-typedef struct {
-    off_t        start;
-    off_t        end;
-    off_t        length;
-    ngx_int_t    flag;         /* -1: no range; 0: xxx-xxx ; 1: xxx-;  2: -xxx; */
-    ngx_str_t    range;
-} ngx_http_nphase_range_t;
-
-typedef struct {
-    ngx_str_t   uri;
-    ngx_int_t   uri_var_index;
-    ngx_int_t   range_var_index;
-} ngx_http_nphase_conf_t;
-
-typedef struct {
-    ngx_uint_t                pr_status;
-    ngx_uint_t                sr_count;
-    ngx_uint_t                sr_count_e;
-    ngx_str_t                 uri_var_value;
-
-    off_t                     wfsz;
-    ngx_array_t               range_in;
-    ngx_http_nphase_range_t   range_sent;
-    
-    ngx_str_t                 loc_body_c;
-    unsigned                  sr_done:1;
-    unsigned                  sr_error:1;
-    unsigned                  header_sent:1;
-    unsigned                  body_ready:1;
-    unsigned                  loc_ready:1;
-    unsigned                  loc_body:1;
-} ngx_http_nphase_ctx_t;
-
-typedef struct {
-    ngx_http_nphase_range_t   range_sent;
-} ngx_http_nphase_sub_ctx_t;
-
-typedef struct {
-    ngx_int_t                 index;
-    ngx_http_complex_value_t  value;
-    ngx_http_set_variable_pt  set_handler;
-} ngx_http_nphase_variable_t;
-
-#define NGX_HTTP_NPHASE_MAX_RETRY         3
-
-static void * ngx_http_nphase_create_conf(ngx_conf_t *cf);
-static char * ngx_http_nphase_merge_conf(ngx_conf_t *cf, void *parent, void *child);
-static ngx_int_t ngx_http_nphase_init(ngx_conf_t *cf);
-static ngx_int_t ngx_http_nphase_access_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_nphase_content_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_nphase_subrequest_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
-ngx_int_t    ngx_http_nphase_filter_init(ngx_conf_t *cf);    
-static ngx_int_t ngx_http_nphase_header_filter(ngx_http_request_t *r);
-static ngx_int_t ngx_http_nphase_body_filter(ngx_http_request_t *r, ngx_chain_t *in);
-void ngx_http_nphase_discard_bufs(ngx_pool_t *pool, ngx_chain_t *in);
-static char *ngx_http_nphase_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); 
-static char *ngx_http_nphase_set_uri_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
-static char *ngx_http_nphase_set_range_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
-ngx_int_t ngx_http_nphase_range_update(ngx_http_request_t *r, ngx_int_t index, off_t start, off_t end, ngx_int_t flag);
-ngx_int_t ngx_http_nphase_range_parse(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx);
-ngx_int_t ngx_http_nphase_content_range_parse(u_char *p, ngx_http_nphase_range_t *range);
-ngx_int_t ngx_http_nphase_copy_header_value(ngx_list_t *headers, ngx_str_t *k, ngx_str_t *v);
-ngx_int_t ngx_http_nphase_run_subrequest(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
-                                                        ngx_str_t *uri, ngx_str_t *args);
-ngx_int_t ngx_http_nphase_process_header(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx);
-static ngx_int_t ngx_http_nphase_add_range_singlepart_header(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx);
-
-static ngx_command_t  ngx_http_nphase_commands[] = {
-
-    { ngx_string("nphase_uri"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_http_nphase_uri,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
-      
-    { ngx_string("nphase_set_uri_var"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_http_nphase_set_uri_var,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
-
-    { ngx_string("nphase_set_range_var"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_http_nphase_set_range_var,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
-
-      ngx_null_command
-};
-
-static ngx_http_module_t  ngx_http_nphase_module_ctx = {
-    NULL,                            /* preconfiguration */
-    ngx_http_nphase_init,            /* postconfiguration */
-
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
-
-    NULL,                                  /* create server configuration */
-    NULL,                                  /* merge server configuration */
-
-    ngx_http_nphase_create_conf,     /* create location configuration */
-    ngx_http_nphase_merge_conf       /* merge location configuration */
-};
-
-
-ngx_module_t  ngx_http_nphase_module = {
-    NGX_MODULE_V1,
-    &ngx_http_nphase_module_ctx,     /* module context */
-    ngx_http_nphase_commands,        /* module directives */
-    NGX_HTTP_MODULE,                       /* module type */
-    NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
-    NULL,                                  /* init thread */
-    NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
-    NULL,                                  /* exit master */
-    NGX_MODULE_V1_PADDING
-};
-
-static ngx_http_output_header_filter_pt    ngx_http_next_header_filter;
-static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
-
-static void *
-ngx_http_nphase_create_conf(ngx_conf_t *cf)
-{
-    ngx_http_nphase_conf_t  *conf;
-
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_nphase_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
-
-    conf->uri_var_index = NGX_CONF_UNSET_UINT;
-    conf->range_var_index = NGX_CONF_UNSET_UINT;
-    return conf;
-}
-
-
-static char *
-ngx_http_nphase_merge_conf(ngx_conf_t *cf, void *parent, void *child)
-{
-    ngx_http_nphase_conf_t *prev = parent;
-    ngx_http_nphase_conf_t *conf = child;
-
-    ngx_conf_merge_str_value(conf->uri, prev->uri, "");
-    ngx_conf_merge_value(conf->uri_var_index, prev->uri_var_index, -1);
-    ngx_conf_merge_value(conf->range_var_index, prev->range_var_index, -1);
-
-    return NGX_CONF_OK;
-}
-
-
-static ngx_int_t
-ngx_http_nphase_init(ngx_conf_t *cf)
-{
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
-
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
-    if (cmcf == NULL) {
-        return NGX_ERROR;
-    }
-
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
-    }
-
-    *h = ngx_http_nphase_access_handler;
-
-    ngx_http_nphase_filter_init(cf);
-    return NGX_OK;
-}
-
-
-static ngx_int_t
-ngx_http_nphase_access_handler(ngx_http_request_t *r)
-{
-    ngx_http_nphase_ctx_t             *ctx;
-    ngx_http_nphase_conf_t            *npcf;
-    ngx_http_variable_value_t         *var;
-    ngx_int_t                       rc;
-    ngx_http_nphase_range_t         *rin;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "nphase access handler");
-
-    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
-
-    if (npcf->uri.len == 0) {
-        return NGX_DECLINED;
-    }
-
-    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
-
-    if (ctx != NULL) {
-        if (ctx->sr_count_e >= NGX_HTTP_NPHASE_MAX_RETRY) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "nphase subrequest max retry num(%d) reached",
-                          NGX_HTTP_NPHASE_MAX_RETRY);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-        
-        /* phase 2 process */
-        if (ctx->body_ready == 1) {
-            if (ctx->sr_done == 0) {
-                return NGX_AGAIN;
-            }
-            
-            if (ctx->range_in.nelts > 1) {
-                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-            }
-
-            rin = ctx->range_in.elts;
-            
-            ngx_log_debug8(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "nphase rin s:%O e:%O f:%d, sent s:%O e:%O, w:%O, c:%d, ce:%d",
-                   rin->start, rin->end, rin->flag, 
-                   ctx->range_sent.start, ctx->range_sent.end,
-                   ctx->wfsz, ctx->sr_count, ctx->sr_count_e);
-            
-            /* todo: compare ctx->wfsz and range_sent to find out range need send */
-
-            if ((rin->flag == -1 && ctx->range_sent.end < ctx->wfsz) 
-                || (ctx->range_sent.end < rin->end - rin->start + 1))
-            {
-                ctx->loc_ready = 0;
-                ctx->body_ready = 0;
-
-                if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
-                        rin->start + ctx->range_sent.end, 
-                        rin->end ? rin->end : ctx->wfsz, 0)
-                    != NGX_OK) 
-                {
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
-                
-                /* restore next phase subrequest uri to phase 1 uri */
-                var = ngx_http_get_indexed_variable(r, npcf->uri_var_index);
-                if (var == NULL) {
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
-                var->data = ctx->uri_var_value.data;
-                var->len  = ctx->uri_var_value.len;
-                
-                if (ngx_http_nphase_run_subrequest(r, ctx, &npcf->uri, NULL) 
-                        != NGX_OK) 
-                {
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
-                return NGX_AGAIN;
-            }
-            return NGX_OK;
-        }
-
-        /* phase 1 process */
-        if (ctx->loc_ready == 1) {
-            ctx->loc_ready = 0;
-            
-            /* run subrequest by loc_body_c */
-            if (ctx->loc_body_c.len == 0) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-
-            if (ctx->loc_body_c.data[0] == '/') {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-            
-            var = ngx_http_get_indexed_variable(r, npcf->uri_var_index);
-            if (var == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-            var->len = ctx->loc_body_c.len;
-            var->data = ctx->loc_body_c.data;
-            
-            rin = ctx->range_in.elts;
-/*
-if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
-                    rin->start, rin->end, rin->flag)
-                != NGX_OK) 
-                */
-            if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
-                    rin->start + ctx->range_sent.end, 
-                    rin->end ? rin->end : ctx->wfsz, 0)
-                != NGX_OK) 
-            {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-
-            if (ngx_http_nphase_run_subrequest(r, ctx, &npcf->uri, NULL) 
-                    != NGX_OK) 
-            {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-
-            return NGX_AGAIN;
-        }
-        
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "nphase location uri and body both not ready");
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;    
-    }
-
-    /* initial module ctx */
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_nphase_ctx_t));
-    if (ctx == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-    /* parse headers_in range to ctx->range_in */
-    if (r->headers_in.range != NULL) {
-        if (r->headers_in.range->value.len >= 7
-            && ngx_strncasecmp(r->headers_in.range->value.data,
-                           (u_char *) "bytes=", 6)
-               == 0) 
-        {
-            if (ngx_array_init(&ctx->range_in, r->pool, 1, 
-                            sizeof(ngx_http_nphase_range_t))
-                != NGX_OK)
-            {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-
-            rc = ngx_http_nphase_range_parse(r, ctx);
-            
-            if (rc == NGX_OK) {
-                if (ctx->range_in.nelts > 1) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                                  "multipart range request not supported");
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
-                r->allow_ranges = 1;
-            } else {
-                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-            }
-        } else {
-            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-        }
-    } else {
-        if (ngx_array_init(&ctx->range_in, r->pool, 1, 
-                        sizeof(ngx_http_nphase_range_t))
-            != NGX_OK)
-        {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-        
-        ngx_http_nphase_range_t  *range;
-
-        range = ngx_array_push(&ctx->range_in);
-        if (range == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-
-        range->start = 0;
-        range->end   = 0;
-        range->flag  = -1;
-    }
-    
-    rin = ctx->range_in.elts;
-    if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
-            rin->start, rin->end, rin->flag)
-        != NGX_OK) 
-    {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-    /* run a subrequest to nphase_uri */
-    if (ngx_http_nphase_run_subrequest(r, ctx, &npcf->uri, NULL) 
-            != NGX_OK) 
-    {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-    ngx_http_set_ctx(r, ctx, ngx_http_nphase_module);
-
-    /* save phase 1 uri to ctx->uri_var_value */
-    var = ngx_http_get_indexed_variable(r, npcf->uri_var_index);
-    if (var == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
-    ctx->uri_var_value.data = var->data;
-    ctx->uri_var_value.len  = var->len;
-    
-    return NGX_AGAIN;
-}
-
-static ngx_int_t
-ngx_http_nphase_content_handler(ngx_http_request_t *r)
-{
-    ngx_http_nphase_ctx_t   *ctx;
-    
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "nphase content handler");
-
-    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
-
-    /* Entering content phase means valid response has been 
-            received by subrequest. */
-    
-    if (ctx == NULL) {
-        return NGX_DECLINED;
-    }
-
-    if (! ctx->header_sent) {
-        if (ngx_http_send_header(r) == NGX_ERROR) {
-            return NGX_ERROR;
-        }
-    }
-
-    /* send out buf in case of not sending by subrequest */
-    if (r->out && r->out->buf && r->out->buf->pos) {
-        return ngx_http_output_filter(r, NULL);
-    }
-    
-    return NGX_OK;
-}
-
-static ngx_int_t
-ngx_http_nphase_subrequest_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
-{
-    
-    off_t         size = 0;
-    ngx_chain_t   *ln;
-    ngx_http_nphase_ctx_t       *ctx = data;   /* parent ctx */
-    ngx_http_nphase_sub_ctx_t   *sr_ctx;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "nphase subrequest done s:%d", r->headers_out.status);
-
-    sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
-    if (!sr_ctx) {
-        return rc;
-    }
-
-    /* todo: update ctx->range_sent */
-    for (ln = r->parent->out; ln; ln = ln->next) {
-        size += ngx_buf_size(ln->buf);
-    }
-    
-    ctx->range_sent.end = 
-        r->parent->connection->sent + size - r->parent->header_size;
-        
-    if (ctx->range_sent.end < 0) {
-        ctx->range_sent.end = 0;
-    }
-
-    ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "nphase range sent offset:%O", ctx->range_sent.end);
-
-    if (r->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE 
-        && r->headers_out.status != NGX_HTTP_MOVED_TEMPORARILY ) 
-    {
-        ctx->sr_error = 1;
-        ctx->sr_count_e++;
-    }
-
-    // todo: .....
-    if ((r->headers_out.status == NGX_HTTP_OK
-        || r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT)
-        && ctx->range_sent.end == 0) 
-    {
-        /* backend return 200 or 206 without body */
-        ctx->sr_error = 1;
-        ctx->sr_count_e++;
-    }
-    
-    ctx->sr_done = 1;
-    return rc;
-}
-
-ngx_int_t
-ngx_http_nphase_filter_init(ngx_conf_t *cf)
-{
-    ngx_http_next_header_filter = ngx_http_top_header_filter;
-    ngx_http_top_header_filter = ngx_http_nphase_header_filter;
-
-    ngx_http_next_body_filter = ngx_http_top_body_filter;
-    ngx_http_top_body_filter = ngx_http_nphase_body_filter;
-
-    return NGX_OK;
-}
-
-
-static ngx_int_t
-ngx_http_nphase_header_filter(ngx_http_request_t *r)
-{
-    ngx_http_nphase_ctx_t                   *pr_ctx;
-    ngx_http_nphase_sub_ctx_t               *sr_ctx;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-               "nphase header filter status:%d", 
-                   r->headers_out.status);
-                   
-    if (r == r->main) {
-        /* parent request */
-        pr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
-
-        if (! pr_ctx) {
-            return ngx_http_next_header_filter(r);
-        }
-        
-        if (pr_ctx->header_sent) {
-            return NGX_OK;
-        }
-        
-        pr_ctx->header_sent = 1;
-
-        if (pr_ctx->pr_status != 0) {
-            r->headers_out.status = pr_ctx->pr_status;
-        }
-        
-        if (r->headers_out.status == NGX_HTTP_OK) {
-            r->headers_out.content_length_n = pr_ctx->wfsz;
-        }
-        
-        if (r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT) {
-            r->headers_out.content_length_n = pr_ctx->wfsz;
-
-            ngx_http_nphase_add_range_singlepart_header(r, pr_ctx);
-        }
-        
-        return ngx_http_next_header_filter(r);
-    }else{
-        /* sub request */
-        sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
-        
-        if (! sr_ctx) {
-            return ngx_http_next_header_filter(r);
-        }
-
-        if (! r->parent) {
-            return ngx_http_next_header_filter(r);
-        }
-        
-        pr_ctx = ngx_http_get_module_ctx(r->parent, ngx_http_nphase_module);
-        
-        if (! pr_ctx) {
-            return ngx_http_next_header_filter(r);
-        }
-
-        if (pr_ctx->body_ready) {
-            return NGX_OK;
-        }
-
-        if (r->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE 
-            && r->headers_out.status != NGX_HTTP_MOVED_TEMPORARILY ) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-
-        if (r->headers_out.status == NGX_HTTP_MOVED_TEMPORARILY ) {
-            if (ngx_http_nphase_process_header(r, pr_ctx) == NGX_ERROR
-                    && pr_ctx->wfsz == 0) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-            
-            if (! r->headers_out.location) {
-                u_char              *p;
-                size_t              len = 0;
-                
-                ngx_str_t           val;
-                ngx_str_t           key = ngx_string("Location");
-
-                if (ngx_http_nphase_copy_header_value(
-                        &r->headers_out.headers, &key, &val) == NGX_OK) 
-                {
-                    if ( val.data[0] == '/' ) {
-                        len += r->upstream->schema.len;
-                        len += r->upstream->resolved->host.len;
-                        if (len == 0) {
-                            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                        }
-                    }
-
-                    len += val.len;
-                    p = ngx_palloc(r->pool, len);
-                    if (p == NULL) {
-                        return NGX_ERROR;
-                    }
-                    pr_ctx->loc_body_c.data = p;
-                    pr_ctx->loc_body_c.len = len;
-                                    
-                    if ( val.data[0] == '/' ) {
-                        p = ngx_copy(p, r->upstream->schema.data, 
-                                        r->upstream->schema.len);
-                        p = ngx_copy(p, r->upstream->resolved->host.data, 
-                                        r->upstream->resolved->host.len);
-                    }
-                    
-                    p = ngx_copy(p, val.data, val.len);
-                    
-                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                                    "nphase get next phase loc: %V", 
-                                    &pr_ctx->loc_body_c);
-                    
-                    pr_ctx->loc_ready = 1;
-                    return NGX_OK;                
-                }
-
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "nphase get 302 from upstream without location string");
-                return NGX_ERROR;
-            }
-            
-            pr_ctx->loc_body_c.data = ngx_palloc(r->pool, 
-                                        r->headers_out.location->value.len);
-            if (pr_ctx->loc_body_c.data == NULL) {
-                return NGX_ERROR;
-            }
-                            
-            ngx_memcpy(pr_ctx->loc_body_c.data, 
-                        r->headers_out.location->value.data,
-                        r->headers_out.location->value.len);
-            pr_ctx->loc_body_c.len = r->headers_out.location->value.len;
-            
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                            "nphase get next phase loc: %V", 
-                            &pr_ctx->loc_body_c);
-            
-            pr_ctx->loc_ready = 1;
-            return NGX_OK;
-        }
-
-        /* upstream return 20x */
-        pr_ctx->body_ready = 1;
-        return NGX_OK;
-    }
-    
-    return ngx_http_next_header_filter(r);
-}
-
-
-static ngx_int_t
-ngx_http_nphase_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
-{
-    ngx_http_nphase_sub_ctx_t       *sr_ctx;
-    ngx_http_nphase_ctx_t           *pr_ctx;
-    
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "nphase body filter status:%d", 
-                   r->headers_out.status);
-    
-    if (r == r->main) {
-        /* parent request */
-        pr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
-
-        if (! pr_ctx) {
-            return ngx_http_next_body_filter(r, in);
-        }
-        
-        if (pr_ctx->sr_error 
-            && r->headers_out.status < NGX_HTTP_SPECIAL_RESPONSE) 
-        {
-            return ngx_http_next_body_filter(r, NULL);
-        }
-        
-        return ngx_http_next_body_filter(r, in);
-    }else{
-        sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
-        
-        if (!sr_ctx) {
-            return ngx_http_next_body_filter(r, in);
-        }
-    
-        if (! r->parent) {
-            return ngx_http_next_body_filter(r, in);
-        }
-        
-        pr_ctx = ngx_http_get_module_ctx(r->parent, ngx_http_nphase_module);
-        
-        if (! pr_ctx) {
-            return ngx_http_next_body_filter(r, in);
-        }
-
-        if (! pr_ctx->body_ready) {
-            return NGX_OK;
-        }
-        
-        if (! pr_ctx->header_sent){
-            pr_ctx->pr_status = r->headers_out.status;
-
-            if (r->parent->headers_out.content_length_n == -1) {
-                r->parent->headers_out.content_length_n = 
-                    r->headers_out.content_length_n;
-            }
-            
-            if (ngx_http_send_header(r->parent) == NGX_ERROR) {
-                return NGX_ERROR;
-            }
-        }
-
-        return ngx_http_output_filter(r->parent, in);        
-    }
-}
-
-void
-ngx_http_nphase_discard_bufs(ngx_pool_t *pool, ngx_chain_t *in)
-{
-    ngx_chain_t         *cl;
-
-    for (cl = in; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->last;
-        cl->buf->file_pos = cl->buf->file_last;
-    }
-}
-
-static char *
-ngx_http_nphase_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_nphase_conf_t      *npcf = conf;
-    ngx_http_core_loc_conf_t    *clcf;
-    ngx_str_t        *value;
-
-    if (npcf->uri.data != NULL) {
-        return "is duplicate";
-    }
-
-    value = cf->args->elts;
-
-    if (ngx_strcmp(value[1].data, "off") == 0) {
-        npcf->uri.len = 0;
-        npcf->uri.data = (u_char *) "";
-
-        return NGX_CONF_OK;
-    }
-
-    npcf->uri = value[1];
-
-    /* register content phase handler */
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    if (clcf == NULL) {
-        return NGX_CONF_ERROR;
-    }
-    
-    clcf->handler = ngx_http_nphase_content_handler;
-
-    return NGX_CONF_OK;
-}
-
-static char *
-ngx_http_nphase_set_uri_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_nphase_conf_t      *npcf = conf;
-    ngx_str_t                   *value;
-    
-    value = cf->args->elts;
-
-    if (value[1].data[0] != '$') {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid variable name \"%V\"", &value[1]);
-        return NGX_CONF_ERROR;
-    }
-
-    value[1].len--;
-    value[1].data++;
-
-    npcf->uri_var_index = ngx_http_get_variable_index(cf, &value[1]);
-    if (npcf->uri_var_index == NGX_ERROR) {
-        return NGX_CONF_ERROR;
-    }
-
-    return NGX_CONF_OK;
-}
-
-
-static char *
-ngx_http_nphase_set_range_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_nphase_conf_t      *npcf = conf;
-    ngx_str_t                   *value;
-    
-    value = cf->args->elts;
-
-    if (value[1].data[0] != '$') {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid variable name \"%V\"", &value[1]);
-        return NGX_CONF_ERROR;
-    }
-
-    value[1].len--;
-    value[1].data++;
-
-    npcf->range_var_index = ngx_http_get_variable_index(cf, &value[1]);
-    if (npcf->range_var_index == NGX_ERROR) {
-        return NGX_CONF_ERROR;
-    }
-
-    return NGX_CONF_OK;
-}
-
-ngx_int_t
-ngx_http_nphase_range_update(ngx_http_request_t *r, ngx_int_t index, 
-                                            off_t start, off_t end, ngx_int_t flag)
-{
-    ngx_http_variable_value_t         *var;
-    
-    var = ngx_http_get_indexed_variable(r, index);
-    if (var == NULL) {
-        return NGX_ERROR;
-    }
-                    
-    var->data = ngx_pnalloc(r->pool, 
-                    sizeof("bytes=-") + 2 * NGX_OFF_T_LEN);
-    if (var->data == NULL) {
-        return NGX_ERROR;
-    }
-
-    if (flag == 0) {
-        var->len = ngx_sprintf(var->data, "bytes=%O-%O", start, end)
-                        - var->data;
-    } else if (flag == 1) {
-        var->len = ngx_sprintf(var->data, "bytes=%O-", start)
-                        - var->data;
-    } else if (flag == 2) {
-        var->len = ngx_sprintf(var->data, "bytes=-%O", end)
-                        - var->data;
-    } else if (flag == -1) {
-        var->len = ngx_sprintf(var->data, "bytes=0-")
-                        - var->data;
-    } else {
-        return NGX_ERROR;
-    }
-    
-    return NGX_OK;
-}
-
-ngx_int_t
-ngx_http_nphase_range_parse(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
-{
-    u_char            *p;
-    off_t              start, end;
-    ngx_int_t          flag;
-    ngx_uint_t         suffix;
-    ngx_http_nphase_range_t  *range;
-
-    p = r->headers_in.range->value.data + 6;
-
-    for ( ;; ) {
-        start = 0;
-        end = 0;
-        suffix = 0;
-        flag = 0;
-
-        while (*p == ' ') { p++; }
-
-        if (*p != '-') {
-            if (*p < '0' || *p > '9') {
-                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-            }
-
-            while (*p >= '0' && *p <= '9') {
-                start = start * 10 + *p++ - '0';
-            }
-
-            while (*p == ' ') { p++; }
-
-            if (*p++ != '-') {
-                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-            }
-
-            while (*p == ' ') { p++; }
-
-            if (*p == ',' || *p == '\0') {
-                range = ngx_array_push(&ctx->range_in);
-                if (range == NULL) {
-                    return NGX_ERROR;
-                }
-
-                range->start = start;
-                range->end = end;
-                range->flag = 1;
-
-                if (*p++ != ',') {
-                    return NGX_OK;
-                }
-
-                continue;
-            }
-
-        } else {
-            suffix = 1;
-            p++;
-        }
-
-        if (*p < '0' || *p > '9') {
-            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-        }
-
-        while (*p >= '0' && *p <= '9') {
-            end = end * 10 + *p++ - '0';
-        }
-
-        while (*p == ' ') { p++; }
-
-        if (*p != ',' && *p != '\0') {
-            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-        }
-
-        if (suffix) {
-            flag = 2;
-        }
-
-        if (start > end && flag != 1) {
-            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-        }
-
-        range = ngx_array_push(&ctx->range_in);
-        if (range == NULL) {
-            return NGX_ERROR;
-        }
-
-        range->start = start;
-        range->end = end;
-        range->flag = flag;
-
-        if (*p++ != ',') {
-            return NGX_OK;
-        }
-    }
-}
-
-
-ngx_int_t
-ngx_http_nphase_content_range_parse(u_char *p, ngx_http_nphase_range_t *range)
-{
-    off_t              start, end, length;
-    ngx_uint_t         suffix;
-
-    start = 0;
-    end = 0;
-    length = 0;
-    suffix = 0;
-
-    while (*p == ' ') { p++; }
-
-    if (*p != '-') {
-        if (*p < '0' || *p > '9') {
-            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-        }
-
-        while (*p >= '0' && *p <= '9') {
-            start = start * 10 + *p++ - '0';
-        }
-
-        while (*p == ' ') { p++; }
-
-        if (*p++ != '-') {
-            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-        }
-
-        while (*p == ' ') { p++; }
-
-        if (*p == ',' || *p == '\0') {
-            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-        }
-
-    } else {
-        suffix = 1;
-        p++;
-    }
-
-    if (*p < '0' || *p > '9') {
-        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-    }
-
-    while (*p >= '0' && *p <= '9') {
-        end = end * 10 + *p++ - '0';
-    }
-    if (start > end) {
-        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-    }
-    if (!suffix) {
-       range->start = start;
-    }
-    range->end = end;
-
-    while (*p == ' ') { p++; }
-
-    if (*p != '/') {
-        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-    }
-    p++;
-    
-    if (*p < '0' || *p > '9') {
-        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-    }
-    while (*p >= '0' && *p <= '9') {
-        length = length * 10 + *p++ - '0';
-    }
-    range->length = length;
-    if (*p++ != ',') {
-        return NGX_OK;
-    }
-    return NGX_HTTP_RANGE_NOT_SATISFIABLE;
-}
-
-
-ngx_int_t
-ngx_http_nphase_copy_header_value(ngx_list_t *headers, ngx_str_t *k, ngx_str_t *v)
-{
-    ngx_uint_t          n;
-    ngx_table_elt_t     *ho;
-    u_char              *p;
-    size_t              len = 0;
-
-    for (n = 0; n < headers->part.nelts; n++) {
-        ho = &((ngx_table_elt_t *)headers->part.elts)[n];
-        if (ngx_strncmp(ho->key.data, k->data, k->len) == 0) {
-
-            len += ho->value.len;
-            p = ngx_palloc(headers->pool, len);
-            if (p == NULL) {
-                return NGX_ERROR;
-            }
-            
-            v->data = p;
-            v->len = len;
-            p = ngx_copy(p, ho->value.data, ho->value.len);
-            p = 0;
-            
-            return NGX_OK;
-        }
-    }
-
-    return NGX_ERROR;
-}
-
-
-ngx_int_t
-ngx_http_nphase_run_subrequest(ngx_http_request_t *r, 
-                                            ngx_http_nphase_ctx_t *ctx,
-                                            ngx_str_t *uri,
-                                            ngx_str_t *args)
-{
-    ngx_http_post_subrequest_t      *ps;
-    ngx_http_nphase_sub_ctx_t       *sr_ctx;
-    ngx_http_request_t              *sr;
-
-    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
-    if (ps == NULL) {
-        return NGX_ERROR;
-    }
-
-    ps->handler = ngx_http_nphase_subrequest_done;
-    ps->data = ctx;
-    ctx->sr_done = 0;
-
-    if (ngx_http_subrequest(r, uri, args, &sr, ps,
-                            NGX_HTTP_SUBREQUEST_WAITED)
-        != NGX_OK)
-    {
-        return NGX_ERROR;
-    }
-
-    sr_ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_nphase_sub_ctx_t));
-    if (sr_ctx == NULL) {
-        return NGX_ERROR;
-    }
-    ngx_http_set_ctx(sr, sr_ctx, ngx_http_nphase_module);
-
-    ctx->sr_count++;
-    return NGX_OK;
-}
-
-ngx_int_t
-ngx_http_nphase_process_header(ngx_http_request_t *r, 
-                                            ngx_http_nphase_ctx_t *ctx)
-{
-    off_t               fsz;
-    u_char              *p;
-    size_t              len;
-    ngx_str_t           val;
-    ngx_str_t           key = ngx_string("X-NP-File-Size");
-    
-    if (ngx_http_nphase_copy_header_value(
-            &r->headers_out.headers, &key, &val) == NGX_OK) 
-    {
-        fsz = 0;
-        len = val.len;
-        p = val.data;
-        for ( ;; ) {
-
-            while (*p == ' ') { 
-                if (fsz != 0) {
-                    return NGX_ERROR;
-                }
-                p++; 
-                len--; 
-            }
-
-            if (*p < '0' || *p > '9') {
-                return NGX_ERROR;
-            }
-            
-            fsz = fsz * 10 + *p++ - '0';
-            len--;
-            if (len == 0) {
-                ctx->wfsz = fsz;
-                break;
-            }
-        }
-    }
-    return NGX_OK;
-}
-
-
-static ngx_int_t
-ngx_http_nphase_add_range_singlepart_header(ngx_http_request_t *r,
-    ngx_http_nphase_ctx_t *ctx)
-{
-    ngx_table_elt_t   *content_range;
-    ngx_http_nphase_range_t         *rin;
-    ngx_http_nphase_range_t         range;
-
-    rin = ctx->range_in.elts;
-    if (rin->flag == -1) {
-        return NGX_OK;
-    }
-
-    content_range = ngx_list_push(&r->headers_out.headers);
-    if (content_range == NULL) {
-        return NGX_ERROR;
-    }
-
-    r->headers_out.content_range = content_range;
-
-    content_range->hash = 1;
-    ngx_str_set(&content_range->key, "Content-Range");
-
-    content_range->value.data = ngx_pnalloc(r->pool,
-                                    sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
-    if (content_range->value.data == NULL) {
-        return NGX_ERROR;
-    }
-
-    /* "Content-Range: bytes SSSS-EEEE/TTTT" header */
-
-    if (rin->flag == 0) {
-        range.start = rin->start;
-        range.end = rin->end;
-    } else if (rin->flag == 1) {
-        range.start = rin->start;
-        range.end = r->headers_out.content_length_n - 1;
-    } else if (rin->flag == 2) {
-        range.start = r->headers_out.content_length_n - rin->end;
-        range.end = r->headers_out.content_length_n - 1;
-    } else {
-        return NGX_ERROR;
-    }
-
-    content_range->value.len = ngx_sprintf(content_range->value.data,
-                                           "bytes %O-%O/%O",
-                                           range.start, range.end,
-                                           r->headers_out.content_length_n)
-                               - content_range->value.data;
-    
-    r->headers_out.content_length_n = range.end - range.start + 1;
-
-    if (r->headers_out.content_length) {
-        r->headers_out.content_length->hash = 0;
-        r->headers_out.content_length = NULL;
-    }
-
-    return NGX_OK;
-}
-
+/*
+ * Copyright (C) Simon Lee@Huawei Tech.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <nginx.h>
+
+typedef struct {
+    off_t        start;
+    off_t        end;
+    off_t        length;
+    ngx_int_t    flag;         /* -1: no range; 0: xxx-xxx ; 1: xxx-;  2: -xxx; */
+    ngx_str_t    range;
+} ngx_http_nphase_range_t;
+
+typedef struct {
+    ngx_str_t         uri;
+    ngx_int_t         uri_var_index;
+    ngx_int_t         range_var_index;
+    ngx_http_complex_value_t  *metadata;
+    ngx_shm_zone_t   *loc_cache_zone;
+    ngx_shm_zone_t   *balance_zone;
+    time_t            loc_cache_ttl;
+    time_t            loc_cache_lock;  /* 0: lookups are not collapsed */
+    time_t            loc_cache_neg;   /* 0: missing files are not cached */
+    ngx_uint_t        prefetch;
+    ngx_flag_t        prefetch_data;
+    size_t            prefetch_buffer;
+    ngx_uint_t        prefetch_at;     /* percent of a segment, 0: at once */
+    ngx_flag_t        stripe;
+    ngx_flag_t        resolve;
+    ngx_uint_t        retry;
+    ngx_msec_t        retry_backoff;
+    ngx_uint_t        retry_on;
+    ngx_msec_t        hedge;
+    size_t            steal_rate;
+    size_t            steal_min;
+    ngx_uint_t        max_conns;
+    ngx_msec_t        queue_timeout;
+    size_t            align;       /* 0: phase 2 asks the exact range */
+    ngx_str_t         local_root;  /* file:// locations are read here */
+    size_t            buffers;     /* 0: no budget for unsent data */
+    ngx_flag_t        early_headers;
+    ngx_flag_t        conditional; /* answer conditions from phase 1 */
+} ngx_http_nphase_conf_t;
+
+/* what nphase_retry_on retries */
+#define NGX_HTTP_NPHASE_FT_ERROR          0x0002
+#define NGX_HTTP_NPHASE_FT_TIMEOUT        0x0004
+#define NGX_HTTP_NPHASE_FT_HTTP_500       0x0008
+#define NGX_HTTP_NPHASE_FT_HTTP_503       0x0010
+#define NGX_HTTP_NPHASE_FT_HTTP_403       0x0020
+#define NGX_HTTP_NPHASE_FT_HTTP_404       0x0040
+#define NGX_HTTP_NPHASE_FT_HTTP_429       0x0080
+#define NGX_HTTP_NPHASE_FT_OFF            0x8000
+
+typedef struct {
+    u_char                   *data;
+    size_t                    size;
+} ngx_http_nphase_strbuf_t;
+
+/* prefetched segment states */
+#define NGX_HTTP_NPHASE_SEG_LOOKUP        0
+#define NGX_HTTP_NPHASE_SEG_LOCATED       1
+#define NGX_HTTP_NPHASE_SEG_FETCH         2
+#define NGX_HTTP_NPHASE_SEG_DONE          3
+#define NGX_HTTP_NPHASE_SEG_ERROR         4
+#define NGX_HTTP_NPHASE_SEG_RESOLVE       5   /* lookup waits for a name */
+
+typedef struct {
+    ngx_queue_t               queue;
+    off_t                     start;       /* absolute file offset */
+    off_t                     end;         /* last byte wanted */
+    ngx_str_t                 key;         /* location cache key */
+    ngx_str_t                 loc;
+    ngx_uint_t                status;
+    ngx_http_request_t       *sr;          /* running phase 2 */
+    ngx_chain_t              *out;         /* body held until promoted */
+    off_t                     held;
+    off_t                     received;    /* body bytes of this stripe */
+    ngx_uint_t                part;        /* index in range_in */
+    ngx_uint_t                nsr;         /* subrequests still running */
+    ngx_http_nphase_strbuf_t  loc_buf;     /* kept when recycled */
+    u_char                    range_buf[sizeof("bytes=-") - 1 
+                                        + 2 * NGX_OFF_T_LEN];
+    unsigned                  state:3;
+    unsigned                  promoted:1;
+    unsigned                  discard:1;
+    unsigned                  hedge:1;     /* same range, another replica */
+} ngx_http_nphase_seg_t;
+
+typedef struct {
+    ngx_str_t                 host;        /* "host:port" of the uri */
+    ngx_str_t                 path;
+    ngx_sockaddr_t            sockaddr;
+    socklen_t                 socklen;     /* 0: not resolved */
+} ngx_http_nphase_peer_t;
+
+typedef struct {
+    ngx_queue_t               queue;
+    ngx_resolver_ctx_t       *rctx;        /* NULL: answered */
+    ngx_http_request_t       *request;
+    ngx_http_nphase_peer_t   *peer;        /* set while answered at once */
+    ngx_str_t                 name;
+    ngx_http_nphase_strbuf_t  name_buf;    /* kept when recycled */
+    unsigned                  failed:1;
+} ngx_http_nphase_resolve_t;
+
+typedef struct {
+    ngx_rbtree_t              rbtree;
+    ngx_rbtree_node_t         sentinel;
+    ngx_queue_t               queue;
+} ngx_http_nphase_balance_sh_t;
+
+typedef struct {
+    ngx_http_nphase_balance_sh_t    *sh;
+    ngx_slab_pool_t                 *shpool;
+    ngx_uint_t                       max_fails;
+    ngx_msec_t                       fail_timeout;
+} ngx_http_nphase_balance_t;
+
+typedef struct {
+    ngx_str_node_t            sn;          /* "host:port" of a chunk server */
+    ngx_queue_t               queue;
+    ngx_queue_t               waiters;     /* nphase_backend_max_conns */
+    ngx_msec_t                latency;     /* EWMA of the time to headers */
+    ngx_uint_t                inflight;    /* phase 2 running, all workers */
+    ngx_uint_t                fails;       /* EWMA of failures, per mille */
+    ngx_uint_t                failed;      /* in a row, breaker */
+    ngx_msec_t                opened;
+    ngx_msec_t                probe;       /* half open, one asked then */
+    u_char                    data[1];
+} ngx_http_nphase_balance_node_t;
+
+typedef struct {
+    ngx_queue_t               queue;       /* in waiters, oldest first */
+    ngx_pid_t                 pid;
+    ngx_uint_t                max;
+    ngx_msec_t                expire;      /* dropped from the line then */
+    unsigned                  granted:1;   /* inflight counted for it */
+} ngx_http_nphase_balance_wait_t;
+
+typedef struct {
+    ngx_uint_t                pr_status;
+    ngx_uint_t                sr_count;
+    ngx_uint_t                sr_count_e;
+    ngx_str_t                 uri_var_value;
+    ngx_str_t                 neg_key;     /* "host uri_var_value" */
+    ngx_str_t                 sr_uri;      /* taken by the next subrequest */
+    ngx_str_t                 sr_range;
+
+    off_t                     wfsz;
+    ngx_str_t                 etag;        /* validators from phase 1 */
+    time_t                    last_modified;
+    ngx_array_t               range_in;
+    ngx_http_nphase_range_t   range_sent;
+    
+    ngx_str_t                 loc_body_c;
+    off_t                     loc_offset;  /* -1: lookup not cacheable */
+    ngx_str_t                 loc_key;
+    ngx_shm_zone_t           *loc_zone;    /* loc_key is locked in */
+    off_t                     loc_end;     /* segment end, -1: unknown */
+    off_t                     fetch_start; /* range asked from phase 2 */
+    off_t                     fetch_end;
+    off_t                     fetch_skip;  /* front of the block not sent */
+    unsigned                  sr_done:1;
+    unsigned                  sr_error:1;
+    unsigned                  header_sent:1;
+    unsigned                  body_ready:1;
+    unsigned                  loc_ready:1;
+    unsigned                  loc_body:1;
+    unsigned                  loc_cached:1;
+    unsigned                  loc_stale:1;
+    unsigned                  loc_locked:1; /* phase 1 others wait for */
+    unsigned                  loc_waiting:1;
+    unsigned                  fetching:1;  /* phase 2 runs in foreground */
+    ngx_uint_t                missing;     /* 404 or 410 from phase 1 */
+
+    ngx_queue_t               prefetch;
+    ngx_uint_t                prefetch_n;
+    off_t                     prefetch_held;
+    off_t                     prefetch_at; /* body bytes before the lookup */
+    ngx_http_nphase_seg_t    *seg_cur;     /* promoted, still running */
+    ngx_queue_t               seg_free;
+
+    /* reused by every loop, the footprint does not grow with segments */
+    ngx_http_post_subrequest_t  ps;
+    ngx_http_nphase_strbuf_t  loc_buf;
+    u_char                    range_buf[sizeof("bytes=-") - 1 
+                                        + 2 * NGX_OFF_T_LEN];
+
+    ngx_uint_t                part;        /* current range of range_in */
+    ngx_atomic_uint_t         boundary;
+    ngx_str_t                 boundary_header;
+    ngx_str_t                 content_type;
+    ngx_array_t              *extents;     /* resolved locations */
+    unsigned                  seg_map:1;
+    unsigned                  multipart:1;
+    unsigned                  parts_resolved:1;
+    unsigned                  parts_started:1;
+    unsigned                  part_pending:1;
+
+    ngx_queue_t               resolving;   /* chunk server name lookups */
+    ngx_queue_t               resolve_free;
+    unsigned                  cln:1;
+
+    ngx_str_t                 replicas;    /* left for the current segment */
+    ngx_http_nphase_strbuf_t  replica_buf;
+    ngx_event_t               retry_ev;    /* backoff */
+
+    ngx_http_request_t       *sr_fg;       /* running foreground */
+    ngx_http_nphase_seg_t    *hedge;
+    ngx_event_t               hedge_ev;
+    unsigned                  hedge_won:1;
+
+    ngx_http_nphase_balance_t  *balance;   /* nphase_balance zone */
+    ngx_event_t               loc_ev;      /* waits for a locked lookup */
+    ngx_event_t               queue_ev;    /* nphase_backend_max_conns */
+    ngx_msec_t                queue_start;
+    ngx_http_nphase_balance_wait_t  *wait; /* in line in the zone */
+    ngx_queue_t               wait_queue;  /* in ngx_http_nphase_waiting */
+    unsigned                  queued:1;
+    unsigned                  queue_switched:1;
+    unsigned                  reserved:1;  /* slot taken, no subrequest yet */
+
+    ngx_pool_t               *local_pool;  /* holds the open local file */
+    ngx_file_t                local_file;
+    off_t                     local_size;
+    ngx_buf_t                *local_buf;   /* sent last, for backpressure */
+
+    off_t                     steal_cut;   /* last byte of the foreground */
+    unsigned                  steal_abort:1;
+    unsigned                  sr_pending:1; /* waits for the lookup */
+} ngx_http_nphase_ctx_t;
+
+typedef struct {
+    off_t                     start;
+    off_t                     end;
+    ngx_str_t                 loc;
+} ngx_http_nphase_extent_t;
+
+typedef struct {
+    ngx_http_nphase_range_t   range_sent;
+    ngx_str_t                 uri;         /* $nphase_uri */
+    ngx_str_t                 range;       /* $nphase_range */
+    ngx_http_nphase_seg_t    *seg;         /* prefetch only */
+    ngx_http_nphase_peer_t    peer;        /* nphase_dynamic upstream */
+    off_t                     received;
+    ngx_msec_t                rate_start;  /* nphase_steal window */
+    off_t                     rate_received;
+    ngx_msec_t                balance_start;
+    ngx_event_t               abort_ev;    /* lost a race, to be stopped */
+    unsigned                  phase:2;
+    unsigned                  done:1;
+    unsigned                  aborted:1;
+    unsigned                  balanced:1;  /* counted as in flight */
+    unsigned                  balance_header:1;
+    unsigned                  balance_probe:1;
+} ngx_http_nphase_sub_ctx_t;
+
+/* filter in front of the missing files, about 2% false positives when full */
+#define NGX_HTTP_NPHASE_BLOOM_BITS        65536
+#define NGX_HTTP_NPHASE_BLOOM_HASHES      3
+#define NGX_HTTP_NPHASE_BLOOM_MAX         6144
+
+typedef struct {
+    ngx_rbtree_t              rbtree;
+    ngx_rbtree_node_t         sentinel;
+    ngx_queue_t               queue;
+    ngx_uint_t                bloom_n;     /* keys set since the last clear */
+    u_char                    bloom[NGX_HTTP_NPHASE_BLOOM_BITS / 8];
+} ngx_http_nphase_loc_cache_sh_t;
+
+typedef struct {
+    ngx_http_nphase_loc_cache_sh_t  *sh;
+    ngx_slab_pool_t                 *shpool;
+} ngx_http_nphase_loc_cache_t;
+
+typedef struct {
+    u_char                    color;
+    u_char                    etag_len;
+    u_short                   len;
+    u_short                   loc_len;
+    u_short                   status;      /* a missing file, no location */
+    ngx_queue_t               queue;
+    time_t                    expire;
+    time_t                    last_modified;
+    off_t                     wfsz;
+    u_char                    data[1];     /* key, location, then etag */
+} ngx_http_nphase_loc_node_t;
+
+typedef struct {
+    ngx_int_t                 index;
+    ngx_http_complex_value_t  value;
+    ngx_http_set_variable_pt  set_handler;
+} ngx_http_nphase_variable_t;
+
+#define NGX_HTTP_NPHASE_MAX_RETRY         3
+#define NGX_HTTP_NPHASE_MAX_BACKOFF_SHIFT 6
+#define NGX_HTTP_NPHASE_STEAL_WINDOW      1000
+#define NGX_HTTP_NPHASE_STEAL_MIN         (1024 * 1024)
+#define NGX_HTTP_NPHASE_LOC_CACHE_TTL     60
+#define NGX_HTTP_NPHASE_BALANCE_SHIFT     3   /* EWMA weight 1/8 */
+#define NGX_HTTP_NPHASE_BALANCE_SCALE     16  /* latency in 1/16 ms */
+#define NGX_HTTP_NPHASE_BALANCE_CHOICES   8
+#define NGX_HTTP_NPHASE_BALANCE_DOWN      ((ngx_uint_t) -1)
+#define NGX_HTTP_NPHASE_MAX_FAILS         3
+#define NGX_HTTP_NPHASE_FAIL_TIMEOUT      10000
+#define NGX_HTTP_NPHASE_QUEUE_TIMEOUT     1000
+#define NGX_HTTP_NPHASE_QUEUE_POLL        20
+#define NGX_HTTP_NPHASE_QUEUE_GRACE       1000
+#define NGX_HTTP_NPHASE_PREFETCH_BUFFER   (4 * 1024 * 1024)
+#define NGX_HTTP_NPHASE_MAX_EXTENTS       1024
+
+static void * ngx_http_nphase_create_conf(ngx_conf_t *cf);
+static char * ngx_http_nphase_merge_conf(ngx_conf_t *cf, void *parent, void *child);
+static ngx_int_t ngx_http_nphase_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_nphase_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_nphase_access_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_nphase_access_loop(ngx_http_request_t *r);
+static ngx_int_t ngx_http_nphase_content_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_nphase_subrequest_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+ngx_int_t    ngx_http_nphase_filter_init(ngx_conf_t *cf);    
+static ngx_int_t ngx_http_nphase_header_filter(ngx_http_request_t *r);
+static ngx_int_t ngx_http_nphase_body_filter(ngx_http_request_t *r, ngx_chain_t *in);
+void ngx_http_nphase_discard_bufs(ngx_pool_t *pool, ngx_chain_t *in);
+static char *ngx_http_nphase_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); 
+static char *ngx_http_nphase_set_uri_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_nphase_set_range_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_nphase_range_update(ngx_http_request_t *r, ngx_int_t index, off_t start, off_t end, ngx_int_t flag);
+ngx_int_t ngx_http_nphase_range_parse(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx);
+ngx_int_t ngx_http_nphase_content_range_parse(u_char *p, ngx_http_nphase_range_t *range);
+ngx_int_t ngx_http_nphase_copy_header_value(ngx_list_t *headers, ngx_str_t *k, ngx_str_t *v);
+ngx_int_t ngx_http_nphase_run_subrequest(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+                                                        ngx_str_t *uri, ngx_str_t *args);
+ngx_int_t ngx_http_nphase_process_header(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_process_validators(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_add_validators(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_not_modified(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_add_range_singlepart_header(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_add_range_multipart_header(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_multipart_init(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_multipart_next(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_chain_t *ngx_http_nphase_multipart_part(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_multipart_finish(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_extent_push(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, off_t start, off_t end, ngx_str_t *loc,
+    ngx_uint_t copy);
+static void ngx_http_nphase_extent_add(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_str_t *loc);
+static ngx_int_t ngx_http_nphase_extent_find(ngx_http_nphase_ctx_t *ctx,
+    off_t offset, ngx_str_t *loc, off_t *end);
+static ngx_int_t ngx_http_nphase_segment_range(ngx_http_request_t *r,
+    off_t *start, off_t *end);
+static void ngx_http_nphase_extent_drop(ngx_http_nphase_ctx_t *ctx,
+    off_t offset, ngx_str_t *loc);
+static void ngx_http_nphase_parse_segment_map(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_absolute_location(ngx_http_request_t *r,
+    ngx_str_t *val, ngx_str_t *loc, ngx_http_nphase_strbuf_t *buf);
+static u_char *ngx_http_nphase_reserve(ngx_pool_t *pool,
+    ngx_http_nphase_strbuf_t *buf, size_t len);
+static ngx_int_t ngx_http_nphase_uri_update(ngx_http_request_t *r,
+    ngx_int_t index, ngx_str_t *uri);
+static ngx_int_t ngx_http_nphase_run_location(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_conf_t *npcf);
+static char *ngx_http_nphase_location_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_nphase_loc_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_nphase_loc_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_nphase_loc_node_t *ngx_http_nphase_loc_cache_find(
+    ngx_http_nphase_loc_cache_t *cache, ngx_str_t *key, uint32_t hash);
+static void ngx_http_nphase_loc_cache_remove(ngx_http_nphase_loc_cache_t *cache,
+    ngx_http_nphase_loc_node_t *lcn);
+static void ngx_http_nphase_loc_cache_expire(ngx_http_nphase_loc_cache_t *cache,
+    ngx_uint_t force);
+static ngx_int_t ngx_http_nphase_loc_cache_lookup(ngx_http_request_t *r,
+    ngx_http_nphase_conf_t *npcf, ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_loc_cache_key(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, off_t offset, ngx_str_t *key);
+static ngx_int_t ngx_http_nphase_loc_cache_get(ngx_http_request_t *r,
+    ngx_str_t *key, ngx_str_t *loc, off_t *wfsz, ngx_http_nphase_strbuf_t *buf,
+    ngx_str_t *etag, time_t *last_modified);
+static ngx_int_t ngx_http_nphase_loc_cache_lock(ngx_http_request_t *r,
+    ngx_http_nphase_conf_t *npcf, ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_loc_cache_unlock(ngx_log_t *log,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_rbtree_node_t *ngx_http_nphase_loc_cache_alloc(
+    ngx_http_nphase_loc_cache_t *cache, size_t size);
+static ngx_int_t ngx_http_nphase_run_lookup(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_conf_t *npcf);
+static void ngx_http_nphase_loc_wait_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_nphase_loc_cache_insert(ngx_http_request_t *r,
+    ngx_str_t *key, ngx_str_t *loc, off_t wfsz, ngx_str_t *etag,
+    time_t last_modified);
+static void ngx_http_nphase_loc_cache_delete(ngx_http_request_t *r,
+    ngx_str_t *key);
+static void ngx_http_nphase_loc_cache_drop(ngx_http_nphase_loc_cache_t *cache,
+    ngx_str_t *key);
+static ngx_int_t ngx_http_nphase_neg_cache_get(ngx_http_request_t *r,
+    ngx_http_nphase_conf_t *npcf, ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_neg_cache_insert(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_uint_t status);
+static uint32_t ngx_http_nphase_bloom_bits(ngx_str_t *key, ngx_uint_t *bit);
+static ngx_int_t ngx_http_nphase_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_nphase_cache_key_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_nphase_parse_location(ngx_http_request_t *r,
+    ngx_str_t *loc, ngx_http_nphase_strbuf_t *buf);
+static void ngx_http_nphase_stripe_sent(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_seg_t *seg);
+static ngx_http_nphase_range_t *ngx_http_nphase_range_cur(
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_uint_t ngx_http_nphase_range_pending(ngx_http_nphase_ctx_t *ctx);
+static off_t ngx_http_nphase_range_last(ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_content_range(ngx_http_request_t *r,
+    ngx_http_nphase_range_t *cr);
+static off_t ngx_http_nphase_range_next_end(ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_loc_host(ngx_str_t *loc, ngx_str_t *host);
+static char *ngx_http_nphase_stripe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_nphase_prefetch_schedule(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_uint_t ngx_http_nphase_prefetch_host_busy(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_seg_t *seg);
+static char *ngx_http_nphase_prefetch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_nphase_run_prefetch(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg, ngx_uint_t phase);
+static void ngx_http_nphase_prefetch_next(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_prefetch_header(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx);
+static ngx_int_t ngx_http_nphase_prefetch_done(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx);
+static ngx_int_t ngx_http_nphase_prefetch_take(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_conf_t *npcf, off_t offset);
+static void ngx_http_nphase_prefetch_start(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg);
+static ngx_http_nphase_seg_t *ngx_http_nphase_seg_alloc(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_seg_release(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_seg_t *seg);
+#if (NGX_DEBUG)
+static void ngx_http_nphase_debug_retained(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+#endif
+static void ngx_http_nphase_prefetch_lookup(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg);
+static void ngx_http_nphase_prefetch_fetch(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg);
+static void ngx_http_nphase_prefetch_discard(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg);
+static void ngx_http_nphase_prefetch_cancel(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_prefetch_resume(ngx_http_nphase_seg_t *seg);
+static ngx_int_t ngx_http_nphase_peer_lookup(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_str_t *uri, ngx_http_nphase_peer_t *peer);
+static ngx_int_t ngx_http_nphase_peer_resolve(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_str_t *name, ngx_http_nphase_peer_t *peer);
+static void ngx_http_nphase_peer_resolved(ngx_resolver_ctx_t *rctx);
+static void ngx_http_nphase_cleanup(void *data);
+static ngx_int_t ngx_http_nphase_add_cleanup(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static char *ngx_http_nphase_retry(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static void ngx_http_nphase_retry_next(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_str_t *loc, ngx_uint_t status);
+static void ngx_http_nphase_retry_handler(ngx_event_t *ev);
+static void ngx_http_nphase_parse_replicas(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_replica_next(ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *loc);
+static void ngx_http_nphase_hedge_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_nphase_hedge_done(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_uint_t error);
+static void ngx_http_nphase_hedge_stop(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_extent_other(ngx_http_nphase_ctx_t *ctx,
+    off_t offset, ngx_str_t *loc);
+static void ngx_http_nphase_abort(ngx_http_request_t *sr);
+static void ngx_http_nphase_abort_handler(ngx_event_t *ev);
+static void ngx_http_nphase_abort_cleanup(void *data);
+static char *ngx_http_nphase_steal(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_nphase_balance(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_nphase_balance_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_http_nphase_balance_node_t *ngx_http_nphase_balance_node(
+    ngx_http_nphase_balance_t *bal, ngx_str_t *loc, ngx_uint_t create);
+static ngx_uint_t ngx_http_nphase_balance_cost(ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *loc);
+static ngx_int_t ngx_http_nphase_balance_reserve(ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *loc, ngx_uint_t max);
+static void ngx_http_nphase_balance_release(ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *loc);
+static void ngx_http_nphase_balance_begin(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_sub_ctx_t *sr_ctx);
+static char *ngx_http_nphase_max_conns(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_nphase_admit(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_conf_t *npcf);
+static void ngx_http_nphase_queue_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_nphase_balance_wait(ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *loc, ngx_uint_t max, ngx_msec_t timeout);
+static ngx_int_t ngx_http_nphase_balance_unwait(ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_balance_grant(
+    ngx_http_nphase_balance_node_t *bn);
+static void ngx_http_nphase_wait_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_nphase_init_process(ngx_cycle_t *cycle);
+static void ngx_http_nphase_balance_header(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_sub_ctx_t *sr_ctx);
+static void ngx_http_nphase_balance_end(ngx_log_t *log,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx,
+    ngx_uint_t error);
+static ngx_uint_t ngx_http_nphase_balance_choose(ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *cand, ngx_uint_t n);
+static ngx_int_t ngx_http_nphase_extent_pick(ngx_http_nphase_ctx_t *ctx,
+    off_t offset, ngx_str_t *skip);
+static void ngx_http_nphase_reverse(u_char *p, u_char *last);
+static void ngx_http_nphase_steal_check(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx);
+static ngx_chain_t *ngx_http_nphase_steal_trim(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx,
+    ngx_chain_t *in);
+static ngx_chain_t *ngx_http_nphase_align_skip(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_chain_t *in);
+static ngx_uint_t ngx_http_nphase_is_local(ngx_http_nphase_conf_t *npcf,
+    ngx_str_t *loc);
+static ngx_uint_t ngx_http_nphase_over_budget(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static void ngx_http_nphase_free_links(ngx_pool_t *pool, ngx_chain_t *in);
+static ngx_int_t ngx_http_nphase_local_wait(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx);
+static ngx_int_t ngx_http_nphase_run_local(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_conf_t *npcf);
+static char *ngx_http_nphase_dynamic(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_nphase_upstream_init(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_nphase_upstream_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_nphase_upstream_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_nphase_upstream_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_conf_bitmask_t  ngx_http_nphase_retry_masks[] = {
+    { ngx_string("error"), NGX_HTTP_NPHASE_FT_ERROR },
+    { ngx_string("timeout"), NGX_HTTP_NPHASE_FT_TIMEOUT },
+    { ngx_string("http_500"), NGX_HTTP_NPHASE_FT_HTTP_500 },
+    { ngx_string("http_503"), NGX_HTTP_NPHASE_FT_HTTP_503 },
+    { ngx_string("http_403"), NGX_HTTP_NPHASE_FT_HTTP_403 },
+    { ngx_string("http_404"), NGX_HTTP_NPHASE_FT_HTTP_404 },
+    { ngx_string("http_429"), NGX_HTTP_NPHASE_FT_HTTP_429 },
+    { ngx_string("off"), NGX_HTTP_NPHASE_FT_OFF },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_http_nphase_commands[] = {
+
+    { ngx_string("nphase_uri"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_nphase_uri,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+      
+    { ngx_string("nphase_set_uri_var"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_nphase_set_uri_var,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_set_range_var"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_nphase_set_range_var,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_metadata"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, metadata),
+      NULL },
+
+    { ngx_string("nphase_location_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_nphase_location_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_backend_max_conns"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_nphase_max_conns,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_balance"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_nphase_balance,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_prefetch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_nphase_prefetch,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_stripe"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_nphase_stripe,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_retry"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_nphase_retry,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_retry_on"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, retry_on),
+      &ngx_http_nphase_retry_masks },
+
+    { ngx_string("nphase_hedge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, hedge),
+      NULL },
+
+    { ngx_string("nphase_steal"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_nphase_steal,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nphase_align"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, align),
+      NULL },
+
+    { ngx_string("nphase_early_headers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, early_headers),
+      NULL },
+
+    { ngx_string("nphase_conditional"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, conditional),
+      NULL },
+
+    { ngx_string("nphase_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, buffers),
+      NULL },
+
+    { ngx_string("nphase_local_root"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, local_root),
+      NULL },
+
+    { ngx_string("nphase_resolve"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_nphase_conf_t, resolve),
+      NULL },
+
+    { ngx_string("nphase_dynamic"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
+      ngx_http_nphase_dynamic,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+static ngx_http_variable_t  ngx_http_nphase_vars[] = {
+
+    { ngx_string("nphase_uri"), NULL, ngx_http_nphase_variable,
+      offsetof(ngx_http_nphase_sub_ctx_t, uri), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("nphase_range"), NULL, ngx_http_nphase_variable,
+      offsetof(ngx_http_nphase_sub_ctx_t, range), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("nphase_host"), NULL, ngx_http_nphase_variable,
+      offsetof(ngx_http_nphase_sub_ctx_t, peer.host),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("nphase_path"), NULL, ngx_http_nphase_variable,
+      offsetof(ngx_http_nphase_sub_ctx_t, peer.path),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("nphase_cache_key"), NULL,
+      ngx_http_nphase_cache_key_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+static ngx_http_module_t  ngx_http_nphase_module_ctx = {
+    ngx_http_nphase_add_variables,   /* preconfiguration */
+    ngx_http_nphase_init,            /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_nphase_create_conf,     /* create location configuration */
+    ngx_http_nphase_merge_conf       /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_nphase_module = {
+    NGX_MODULE_V1,
+    &ngx_http_nphase_module_ctx,     /* module context */
+    ngx_http_nphase_commands,        /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_nphase_init_process,    /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+static ngx_http_output_header_filter_pt    ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+/* requests of this worker in line for a chunk server, and their wakeup */
+static ngx_queue_t                        ngx_http_nphase_waiting;
+static ngx_event_t                        ngx_http_nphase_wait_ev;
+
+static void *
+ngx_http_nphase_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_nphase_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_nphase_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->uri_var_index = NGX_CONF_UNSET_UINT;
+    conf->range_var_index = NGX_CONF_UNSET_UINT;
+    conf->loc_cache_zone = NGX_CONF_UNSET_PTR;
+    conf->balance_zone = NGX_CONF_UNSET_PTR;
+    conf->loc_cache_ttl = NGX_CONF_UNSET;
+    conf->loc_cache_lock = NGX_CONF_UNSET;
+    conf->loc_cache_neg = NGX_CONF_UNSET;
+    conf->prefetch = NGX_CONF_UNSET_UINT;
+    conf->prefetch_data = NGX_CONF_UNSET;
+    conf->prefetch_buffer = NGX_CONF_UNSET_SIZE;
+    conf->prefetch_at = NGX_CONF_UNSET_UINT;
+    conf->stripe = NGX_CONF_UNSET;
+    conf->resolve = NGX_CONF_UNSET;
+    conf->retry = NGX_CONF_UNSET_UINT;
+    conf->retry_backoff = NGX_CONF_UNSET_MSEC;
+    conf->hedge = NGX_CONF_UNSET_MSEC;
+    conf->steal_rate = NGX_CONF_UNSET_SIZE;
+    conf->max_conns = NGX_CONF_UNSET_UINT;
+    conf->queue_timeout = NGX_CONF_UNSET_MSEC;
+    conf->steal_min = NGX_CONF_UNSET_SIZE;
+    conf->align = NGX_CONF_UNSET_SIZE;
+    conf->buffers = NGX_CONF_UNSET_SIZE;
+    conf->early_headers = NGX_CONF_UNSET;
+    conf->conditional = NGX_CONF_UNSET;
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->retry_on = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_nphase_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_nphase_conf_t *prev = parent;
+    ngx_http_nphase_conf_t *conf = child;
+
+    ngx_conf_merge_str_value(conf->uri, prev->uri, "");
+    ngx_conf_merge_value(conf->uri_var_index, prev->uri_var_index, -1);
+    ngx_conf_merge_value(conf->range_var_index, prev->range_var_index, -1);
+
+    if (conf->metadata == NULL) {
+        conf->metadata = prev->metadata;
+    }
+
+    if (conf->uri.len && conf->metadata == NULL && conf->uri_var_index == -1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"nphase_uri\" requires \"nphase_metadata\" "
+                           "or \"nphase_set_uri_var\"");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_ptr_value(conf->loc_cache_zone, prev->loc_cache_zone, NULL);
+    ngx_conf_merge_ptr_value(conf->balance_zone, prev->balance_zone, NULL);
+    ngx_conf_merge_uint_value(conf->max_conns, prev->max_conns, 0);
+    ngx_conf_merge_msec_value(conf->queue_timeout, prev->queue_timeout,
+                              NGX_HTTP_NPHASE_QUEUE_TIMEOUT);
+
+    if (conf->max_conns && conf->balance_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"nphase_backend_max_conns\" needs "
+                           "\"nphase_balance\"");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_sec_value(conf->loc_cache_ttl, prev->loc_cache_ttl,
+                             NGX_HTTP_NPHASE_LOC_CACHE_TTL);
+    ngx_conf_merge_sec_value(conf->loc_cache_lock, prev->loc_cache_lock, 0);
+    ngx_conf_merge_sec_value(conf->loc_cache_neg, prev->loc_cache_neg, 0);
+    if (conf->stripe == NGX_CONF_UNSET
+        && conf->prefetch != NGX_CONF_UNSET_UINT)
+    {
+        /* nphase_prefetch here overrides an inherited nphase_stripe */
+        conf->stripe = 0;
+    }
+
+    ngx_conf_merge_value(conf->stripe, prev->stripe, 0);
+    ngx_conf_merge_uint_value(conf->prefetch, prev->prefetch, 0);
+    ngx_conf_merge_value(conf->prefetch_data, prev->prefetch_data, 0);
+    ngx_conf_merge_size_value(conf->prefetch_buffer, prev->prefetch_buffer,
+                              NGX_HTTP_NPHASE_PREFETCH_BUFFER);
+    ngx_conf_merge_uint_value(conf->prefetch_at, prev->prefetch_at, 0);
+    ngx_conf_merge_value(conf->resolve, prev->resolve, 0);
+    ngx_conf_merge_uint_value(conf->retry, prev->retry,
+                              NGX_HTTP_NPHASE_MAX_RETRY);
+    ngx_conf_merge_msec_value(conf->retry_backoff, prev->retry_backoff, 0);
+    ngx_conf_merge_msec_value(conf->hedge, prev->hedge, 0);
+    ngx_conf_merge_size_value(conf->steal_rate, prev->steal_rate, 0);
+    ngx_conf_merge_size_value(conf->steal_min, prev->steal_min,
+                              NGX_HTTP_NPHASE_STEAL_MIN);
+    ngx_conf_merge_size_value(conf->align, prev->align, 0);
+    ngx_conf_merge_size_value(conf->buffers, prev->buffers, 0);
+    ngx_conf_merge_value(conf->early_headers, prev->early_headers, 0);
+    ngx_conf_merge_value(conf->conditional, prev->conditional, 0);
+    ngx_conf_merge_str_value(conf->local_root, prev->local_root, "");
+
+    if (conf->local_root.len
+        && conf->local_root.data[conf->local_root.len - 1] == '/')
+    {
+        conf->local_root.len--;
+    }
+    ngx_conf_merge_bitmask_value(conf->retry_on, prev->retry_on,
+                                 (NGX_CONF_BITMASK_SET
+                                  |NGX_HTTP_NPHASE_FT_ERROR
+                                  |NGX_HTTP_NPHASE_FT_TIMEOUT
+                                  |NGX_HTTP_NPHASE_FT_HTTP_500
+                                  |NGX_HTTP_NPHASE_FT_HTTP_503));
+
+    if (conf->retry_on & NGX_HTTP_NPHASE_FT_OFF) {
+        conf->retry_on = NGX_CONF_BITMASK_SET|NGX_HTTP_NPHASE_FT_OFF;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_nphase_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    if (cmcf == NULL) {
+        return NGX_ERROR;
+    }
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_nphase_access_handler;
+
+    ngx_http_nphase_filter_init(cf);
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_access_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                        rc;
+
+    rc = ngx_http_nphase_access_loop(r);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE && r->header_sent) {
+        /*
+         * nphase_early_headers or a part already sent: too late for an
+         * error status, the connection is closed and the body stays short
+         */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase failed with %i after the header was sent",
+                      rc);
+
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_access_loop(ngx_http_request_t *r)
+{
+    ngx_http_nphase_ctx_t             *ctx;
+    ngx_http_nphase_conf_t            *npcf;
+    ngx_http_variable_value_t         *var;
+    ngx_int_t                       rc;
+    ngx_http_nphase_range_t         *rin;
+    ngx_http_core_loc_conf_t        *clcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase access handler");
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if (npcf->uri.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+    if (ctx != NULL) {
+        if (ctx->sr_count_e >= npcf->retry && ctx->missing) {
+            /* phase 1 says the file does not exist */
+            return ctx->missing;
+        }
+
+        if (ctx->sr_count_e >= npcf->retry) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "nphase subrequest max retry num(%ui) reached",
+                          npcf->retry);
+
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_nphase_prefetch_schedule(r, ctx);
+
+        if (npcf->buffers && ctx->seg_cur
+            && !ngx_http_nphase_over_budget(r, ctx))
+        {
+            /* the client took data, the running segment may read on */
+            ngx_http_nphase_prefetch_resume(ctx->seg_cur);
+        }
+
+        if (ctx->sr_pending) {
+            /* still resolving the name sets it again */
+            ctx->sr_pending = 0;
+
+            if (ngx_http_nphase_run_subrequest(r, ctx, &npcf->uri, NULL)
+                    != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            return NGX_AGAIN;
+        }
+
+        if (ctx->queued) {
+            if (ctx->queue_ev.timer_set) {
+                /* woken up by a prefetch, still no free connection */
+                return NGX_AGAIN;
+            }
+
+            return ngx_http_nphase_run_location(r, ctx, npcf);
+        }
+
+        if (ctx->loc_waiting) {
+            if (ctx->loc_ev.timer_set) {
+                return NGX_AGAIN;
+            }
+
+            /* the lookup this one waited for is done or timed out */
+            ctx->loc_waiting = 0;
+
+            if (!ctx->header_sent) {
+                rc = ngx_http_nphase_neg_cache_get(r, npcf, ctx);
+                if (rc != NGX_DECLINED) {
+                    return rc;
+                }
+            }
+
+            rc = ngx_http_nphase_loc_cache_lookup(r, npcf, ctx);
+            if (rc == NGX_ERROR) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (rc == NGX_OK) {
+                return ngx_http_nphase_run_location(r, ctx, npcf);
+            }
+
+            return ngx_http_nphase_run_lookup(r, ctx, npcf);
+        }
+
+        if (ctx->sr_done == 0) {
+            /* woken up by a prefetch, the current subrequest still runs */
+            return NGX_AGAIN;
+        }
+
+        if (ctx->retry_ev.timer_set) {
+            /* nphase_retry backoff */
+            return NGX_AGAIN;
+        }
+        
+        /* phase 2 process */
+        if (ctx->body_ready == 1) {
+            rc = ngx_http_nphase_local_wait(r, ctx);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            if (ctx->multipart 
+                && ctx->part + 1 < ctx->range_in.nelts
+                && !ngx_http_nphase_range_pending(ctx))
+            {
+                /* next part of the multipart response */
+                ctx->part++;
+                ctx->part_pending = 1;
+                ctx->range_sent.end = 0;
+            }
+
+            rin = ngx_http_nphase_range_cur(ctx);
+            
+            ngx_log_debug8(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase rin s:%O e:%O f:%d, sent s:%O e:%O, w:%O, c:%d, ce:%d",
+                   rin->start, rin->end, rin->flag, 
+                   ctx->range_sent.start, ctx->range_sent.end,
+                   ctx->wfsz, ctx->sr_count, ctx->sr_count_e);
+            
+            /* todo: compare ctx->wfsz and range_sent to find out range need send */
+
+            if (ngx_http_nphase_range_pending(ctx)) {
+                rc = ngx_http_nphase_prefetch_take(r, ctx, npcf,
+                                             rin->start + ctx->range_sent.end);
+                if (rc != NGX_DECLINED) {
+                    return rc;
+                }
+
+                ctx->loc_ready = 0;
+                ctx->body_ready = 0;
+
+                if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
+                        rin->start + ctx->range_sent.end, 
+                        ngx_http_nphase_range_next_end(ctx), 0)
+                    != NGX_OK) 
+                {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+                
+                /* restore next phase subrequest uri to phase 1 uri */
+                if (ngx_http_nphase_uri_update(r, npcf->uri_var_index,
+                                               &ctx->uri_var_value)
+                    != NGX_OK)
+                {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                ctx->loc_offset = (rin->flag == 2) 
+                                  ? -1 : rin->start + ctx->range_sent.end;
+
+                rc = ngx_http_nphase_loc_cache_lookup(r, npcf, ctx);
+                if (rc == NGX_ERROR) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                if (rc == NGX_DECLINED
+                    && ngx_http_nphase_extent_find(ctx, 
+                           rin->start + ctx->range_sent.end, &ctx->loc_body_c,
+                           &ctx->loc_end)
+                       == NGX_OK)
+                {
+                    /* known from the segment map, a failure looks it up */
+                    ctx->loc_cached = 1;
+                    rc = NGX_OK;
+                }
+
+                if (rc == NGX_OK) {
+                    return ngx_http_nphase_run_location(r, ctx, npcf);
+                }
+
+                return ngx_http_nphase_run_lookup(r, ctx, npcf);
+            }
+
+            ngx_http_nphase_prefetch_cancel(r, ctx);
+
+            if (ctx->multipart) {
+                return ngx_http_nphase_multipart_finish(r, ctx);
+            }
+
+            return NGX_OK;
+        }
+
+        /* phase 1 process */
+        if (ctx->loc_ready == 1) {
+            /* from phase 1 or a replica of a failed location */
+            ctx->loc_ready = 0;
+            ctx->sr_error = 0;
+            return ngx_http_nphase_run_location(r, ctx, npcf);
+        }
+
+        if (ctx->loc_stale) {
+            /* cached location failed, ask the metadata server again */
+            ctx->loc_stale = 0;
+            ctx->sr_error = 0;
+
+            rin = ngx_http_nphase_range_cur(ctx);
+            if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
+                    rin->start + ctx->range_sent.end, 
+                    ngx_http_nphase_range_next_end(ctx), 0)
+                != NGX_OK) 
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (ngx_http_nphase_uri_update(r, npcf->uri_var_index,
+                                           &ctx->uri_var_value)
+                != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            return ngx_http_nphase_run_lookup(r, ctx, npcf);
+        }
+        
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase location uri and body both not ready");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;    
+    }
+
+    /* initial module ctx */
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_nphase_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_queue_init(&ctx->prefetch);
+    ngx_queue_init(&ctx->seg_free);
+    ngx_queue_init(&ctx->resolving);
+    ngx_queue_init(&ctx->resolve_free);
+
+    ctx->last_modified = -1;
+
+    if (npcf->balance_zone) {
+        ctx->balance = npcf->balance_zone->data;
+    }
+
+    /* parse headers_in range to ctx->range_in */
+    if (r->headers_in.range != NULL) {
+        if (r->headers_in.range->value.len >= 7
+            && ngx_strncasecmp(r->headers_in.range->value.data,
+                           (u_char *) "bytes=", 6)
+               == 0) 
+        {
+            if (ngx_array_init(&ctx->range_in, r->pool, 1, 
+                            sizeof(ngx_http_nphase_range_t))
+                != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            rc = ngx_http_nphase_range_parse(r, ctx);
+            
+            if (rc == NGX_OK) {
+                clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+                if (ctx->range_in.nelts > clcf->max_ranges) {
+                    /* like the range filter, send the whole file */
+                    rin = ctx->range_in.elts;
+                    rin->start = 0;
+                    rin->end = 0;
+                    rin->flag = -1;
+                    ctx->range_in.nelts = 1;
+
+                } else if (ctx->range_in.nelts > 1) {
+                    ctx->multipart = 1;
+                }
+
+                r->allow_ranges = 1;
+            } else {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
+        } else {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+    } else {
+        if (ngx_array_init(&ctx->range_in, r->pool, 1, 
+                        sizeof(ngx_http_nphase_range_t))
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        
+        ngx_http_nphase_range_t  *range;
+
+        range = ngx_array_push(&ctx->range_in);
+        if (range == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        range->start = 0;
+        range->end   = 0;
+        range->flag  = -1;
+    }
+    
+    /* the range variable is written into the ctx buffer */
+    ngx_http_set_ctx(r, ctx, ngx_http_nphase_module);
+
+    if (ctx->balance) {
+        /* running subrequests leave the in flight count on cleanup */
+        if (ngx_http_nphase_add_cleanup(r, ctx) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    rin = ngx_http_nphase_range_cur(ctx);
+    if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
+            rin->start, rin->end, rin->flag)
+        != NGX_OK) 
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* save phase 1 uri to ctx->uri_var_value */
+    if (npcf->metadata) {
+        if (ngx_http_complex_value(r, npcf->metadata, &ctx->uri_var_value)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+    } else {
+        /* compatibility: the uri set into nphase_set_uri_var */
+        var = ngx_http_get_indexed_variable(r, npcf->uri_var_index);
+        if (var == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ctx->uri_var_value.data = var->data;
+        ctx->uri_var_value.len  = var->len;
+    }
+
+    ctx->sr_uri = ctx->uri_var_value;
+
+    rc = ngx_http_nphase_neg_cache_get(r, npcf, ctx);
+    if (rc != NGX_DECLINED) {
+        /* known to be missing, the metadata server is not asked */
+        return rc;
+    }
+
+    /* a cached location skips phase 1 */
+    ctx->loc_offset = (rin->flag == 2) ? -1 : rin->start;
+
+    rc = ngx_http_nphase_loc_cache_lookup(r, npcf, ctx);
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+        return ngx_http_nphase_run_location(r, ctx, npcf);
+    }
+
+    /* run a subrequest to nphase_uri */
+    return ngx_http_nphase_run_lookup(r, ctx, npcf);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_run_location(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_conf_t *npcf)
+{
+    off_t                            start, end, astart, aend, lend;
+    ngx_int_t                        rc;
+    ngx_str_t                        loc;
+    ngx_http_nphase_range_t         *rin;
+
+    /* run subrequest by loc_body_c */
+    if (ctx->loc_body_c.len == 0) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ctx->multipart && !ctx->parts_resolved) {
+        /* the file size is known now */
+        rc = ngx_http_nphase_multipart_init(r, ctx);
+
+        if (rc == NGX_DECLINED) {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        if (rc == NGX_AGAIN) {
+            /* the first part was dropped, look up the one that is first now */
+
+            rin = ngx_http_nphase_range_cur(ctx);
+
+            if (ngx_http_nphase_range_update(r, npcf->range_var_index,
+                    rin->start, ngx_http_nphase_range_next_end(ctx), 0)
+                != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (ngx_http_nphase_uri_update(r, npcf->uri_var_index,
+                                           &ctx->uri_var_value)
+                != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ctx->loc_offset = rin->start;
+
+            rc = ngx_http_nphase_loc_cache_lookup(r, npcf, ctx);
+            if (rc == NGX_ERROR) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (rc != NGX_OK) {
+                return ngx_http_nphase_run_lookup(r, ctx, npcf);
+            }
+
+        } else if (rc != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (ctx->loc_body_c.data[0] == '/') {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!ctx->header_sent && !ctx->multipart && ctx->wfsz) {
+
+        if (npcf->conditional
+            && ngx_http_nphase_not_modified(r, ctx) == NGX_OK)
+        {
+            ctx->pr_status = NGX_HTTP_NOT_MODIFIED;
+            r->header_only = 1;
+
+        } else if (r->header_only) {
+            rin = ngx_http_nphase_range_cur(ctx);
+
+            ctx->pr_status = (rin->flag == -1) ? NGX_HTTP_OK
+                                               : NGX_HTTP_PARTIAL_CONTENT;
+        }
+
+        if (r->header_only) {
+            /* HEAD or 304, phase 1 told all the header needs */
+
+            ngx_http_nphase_prefetch_cancel(r, ctx);
+
+            rc = ngx_http_send_header(r);
+
+            if (rc == NGX_ERROR || rc > NGX_OK) {
+                return rc;
+            }
+
+            return NGX_OK;
+        }
+    }
+
+    if (npcf->early_headers && !ctx->header_sent && !ctx->multipart
+        && ctx->wfsz)
+    {
+        /* the file size from phase 1 is enough, do not wait for phase 2 */
+
+        rin = ngx_http_nphase_range_cur(ctx);
+
+        ctx->pr_status = (rin->flag == -1) ? NGX_HTTP_OK
+                                           : NGX_HTTP_PARTIAL_CONTENT;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK) {
+            return rc;
+        }
+
+        if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_nphase_is_local(npcf, &ctx->loc_body_c)) {
+        /* the chunk store is on this host, no subrequest */
+        return ngx_http_nphase_run_local(r, ctx, npcf);
+    }
+
+    rc = ngx_http_nphase_admit(r, ctx, npcf);
+
+    if (rc == NGX_BUSY) {
+        /* the access handler runs the location again */
+        return NGX_AGAIN;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    if (ngx_http_nphase_uri_update(r, npcf->uri_var_index, &ctx->loc_body_c)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rin = ngx_http_nphase_range_cur(ctx);
+
+    start = rin->start + ctx->range_sent.end;
+    end = ngx_http_nphase_range_next_end(ctx);
+
+    /* ask exactly for the rest of the segment when its end is known */
+    if (ctx->loc_end >= start && ctx->loc_end < end) {
+        end = ctx->loc_end;
+    }
+
+    ctx->fetch_skip = 0;
+
+    if (npcf->align) {
+        /* whole blocks, so that clients of the same file ask the same */
+
+        astart = start - start % (off_t) npcf->align;
+        aend = astart + (off_t) npcf->align - 1;
+
+        if (aend < end) {
+            if (ctx->loc_end > aend
+                && ngx_http_nphase_extent_find(ctx, aend + 1, &loc, &lend)
+                   != NGX_OK)
+            {
+                /* the next blocks of the segment are on the same server */
+                (void) ngx_http_nphase_extent_push(r, ctx, start,
+                                                   ctx->loc_end,
+                                                   &ctx->loc_body_c, 1);
+            }
+
+            end = aend;
+        }
+
+        ctx->fetch_skip = start - astart;
+        start = astart;
+    }
+
+    ctx->fetch_start = start;
+    ctx->fetch_end = end;
+    ctx->fetching = 1;
+    ctx->steal_cut = 0;
+    ctx->steal_abort = 0;
+    ctx->prefetch_at = 0;
+
+    if (ngx_http_nphase_range_update(r, npcf->range_var_index, 
+            start, end, 0)
+        != NGX_OK) 
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_nphase_run_subrequest(r, ctx, &npcf->uri, NULL) 
+            != NGX_OK) 
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (npcf->hedge && !ctx->sr_pending && ctx->hedge == NULL
+        && ngx_http_nphase_add_cleanup(r, ctx) == NGX_OK)
+    {
+        /* a replica is asked too if no answer comes in time */
+        ctx->hedge_ev.handler = ngx_http_nphase_hedge_handler;
+        ctx->hedge_ev.data = r;
+        ctx->hedge_ev.log = r->connection->log;
+
+        ngx_add_timer(&ctx->hedge_ev, npcf->hedge);
+    }
+
+    return NGX_AGAIN;
+}
+
+static ngx_int_t
+ngx_http_nphase_content_handler(ngx_http_request_t *r)
+{
+    ngx_http_nphase_ctx_t   *ctx;
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase content handler");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+    /* Entering content phase means valid response has been 
+            received by subrequest. */
+    
+    if (ctx == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (! ctx->header_sent) {
+        if (ngx_http_send_header(r) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* send out buf in case of not sending by subrequest */
+    if (r->out && r->out->buf && r->out->buf->pos) {
+        return ngx_http_output_filter(r, NULL);
+    }
+    
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_nphase_subrequest_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+    
+    off_t         received;
+    ngx_uint_t    error = 0;
+    ngx_http_nphase_ctx_t       *ctx = data;   /* parent ctx */
+    ngx_http_nphase_sub_ctx_t   *sr_ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase subrequest done s:%d", r->headers_out.status);
+
+    sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+    if (!sr_ctx) {
+        return rc;
+    }
+
+    if (sr_ctx->done) {
+        return rc;
+    }
+
+    sr_ctx->done = 1;
+
+    if (sr_ctx->balanced) {
+        /* failed as below, a race that was lost is not the server's fault */
+        received = sr_ctx->seg ? sr_ctx->seg->received : sr_ctx->received;
+
+        ngx_http_nphase_balance_end(r->connection->log, ctx, sr_ctx,
+            !sr_ctx->aborted
+            && (sr_ctx->seg == NULL ? !ctx->hedge_won : !sr_ctx->seg->discard)
+            && ((r->headers_out.status != NGX_HTTP_OK
+                 && r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT)
+                || received == 0));
+    }
+
+#if (nginx_version < 1013010)
+    /*
+     * older nginx counts every subrequest of the request, not only the
+     * nested ones; give a finished one back so segments are not capped
+     */
+    r->main->subrequests++;
+#endif
+
+    if (sr_ctx->seg
+        && (!sr_ctx->seg->promoted || sr_ctx->phase == 1)) 
+    {
+        /* a late lookup of a promoted segment is not the current one */
+        return ngx_http_nphase_prefetch_done(r, ctx, sr_ctx);
+    }
+
+    /*
+     * progress comes from the body bytes each subrequest passed on, the
+     * connection counters are shared by h2/h3 streams and keepalive
+     */
+
+    if (sr_ctx->seg) {
+        ngx_http_nphase_stripe_sent(ctx, sr_ctx->seg);
+        received = sr_ctx->seg->received;
+
+    } else {
+        ctx->range_sent.end += sr_ctx->received;
+        received = sr_ctx->received;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase range sent offset:%O received:%O", 
+                   ctx->range_sent.end, received);
+
+    if (r->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE 
+        && r->headers_out.status != NGX_HTTP_MOVED_TEMPORARILY ) 
+    {
+        error = 1;
+    }
+
+    if ((r->headers_out.status == NGX_HTTP_OK
+        || r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT)
+        && received == 0) 
+    {
+        /* backend return 200 or 206 without body */
+        error = 1;
+    }
+
+    if (sr_ctx->seg == NULL) {
+        ctx->sr_fg = NULL;
+
+        if (!ctx->fetching) {
+            /* phase 1 without a location for the others waiting */
+            ngx_http_nphase_loc_cache_unlock(r->connection->log, ctx);
+        }
+
+        if (ngx_http_nphase_hedge_done(r, ctx, error) == NGX_OK) {
+            /* the hedge answered first and goes on in its place */
+            error = 0;
+        }
+    }
+
+    if (error) {
+        /* the failed location of phase 2, NULL for phase 1 */
+        ngx_http_nphase_retry_next(r, ctx, 
+                                   sr_ctx->seg ? &sr_ctx->seg->loc
+                                   : ctx->fetching ? &ctx->loc_body_c : NULL,
+                                   r->headers_out.status);
+
+    } else if (received) {
+        /* nphase_retry counts the attempts of one segment */
+        ctx->sr_count_e = 0;
+    }
+    
+    ctx->sr_done = 1;
+
+    if (sr_ctx->seg) {
+        /* a promoted prefetch runs in background, wake up the main loop */
+        sr_ctx->seg->state = NGX_HTTP_NPHASE_SEG_DONE;
+        sr_ctx->seg->sr = NULL;
+        sr_ctx->seg->nsr--;
+        ngx_http_nphase_seg_release(ctx, sr_ctx->seg);
+        ctx->seg_cur = NULL;
+        ngx_http_post_request(r->parent, NULL);
+    }
+
+#if (NGX_DEBUG)
+    ngx_http_nphase_debug_retained(r->main, ctx);
+#endif
+
+    return rc;
+}
+
+
+
+#if (NGX_DEBUG)
+
+static void
+ngx_http_nphase_debug_retained(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    size_t                           size;
+    ngx_uint_t                       large, free;
+    ngx_pool_t                      *pool;
+    ngx_queue_t                     *q;
+    ngx_pool_large_t                *l;
+
+    /* what the request holds after sr_count subrequests */
+
+    size = 0;
+    for (pool = r->pool; pool; pool = pool->d.next) {
+        size += pool->d.end - (u_char *) pool;
+    }
+
+    large = 0;
+    for (l = r->pool->large; l; l = l->next) {
+        if (l->alloc) {
+            large++;
+        }
+    }
+
+    free = 0;
+    for (q = ngx_queue_head(&ctx->seg_free);
+         q != ngx_queue_sentinel(&ctx->seg_free);
+         q = ngx_queue_next(q))
+    {
+        free++;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase retained: pool:%uz large:%ui "
+                   "subrequests:%ui free segments:%ui",
+                   size, large, ctx->sr_count, free);
+}
+
+#endif
+
+
+static void
+ngx_http_nphase_stripe_sent(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_seg_t *seg)
+{
+    ngx_http_nphase_range_t         *rin;
+
+    /* a stripe knows exactly how much of its range it delivered */
+
+    rin = ngx_http_nphase_range_cur(ctx);
+
+    ctx->range_sent.end = seg->start + seg->received - rin->start;
+}
+
+ngx_int_t
+ngx_http_nphase_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_nphase_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_nphase_body_filter;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_header_filter(ngx_http_request_t *r)
+{
+    off_t                                    start, end;
+    ngx_int_t                                rc;
+    ngx_http_nphase_range_t                  cr;
+    ngx_http_nphase_ctx_t                   *pr_ctx;
+    ngx_http_nphase_conf_t                  *npcf;
+    ngx_http_nphase_sub_ctx_t               *sr_ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+               "nphase header filter status:%d", 
+                   r->headers_out.status);
+                   
+    if (r == r->main) {
+        /* parent request */
+        pr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+        if (! pr_ctx) {
+            return ngx_http_next_header_filter(r);
+        }
+        
+        if (pr_ctx->header_sent) {
+            return NGX_OK;
+        }
+        
+        pr_ctx->header_sent = 1;
+
+        if (pr_ctx->pr_status != 0) {
+            r->headers_out.status = pr_ctx->pr_status;
+        }
+
+        npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+        if (npcf->conditional) {
+            /* conditions were checked against phase 1 already */
+            r->disable_not_modified = 1;
+
+            if (ngx_http_nphase_add_validators(r, pr_ctx) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (r->headers_out.status == NGX_HTTP_NOT_MODIFIED) {
+            return ngx_http_next_header_filter(r);
+        }
+
+        if (pr_ctx->multipart) {
+            r->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
+
+            if (ngx_http_nphase_add_range_multipart_header(r, pr_ctx) 
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            return ngx_http_next_header_filter(r);
+        }
+        
+        if (r->headers_out.status == NGX_HTTP_OK) {
+            r->headers_out.content_length_n = pr_ctx->wfsz;
+        }
+        
+        if (r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT) {
+            r->headers_out.content_length_n = pr_ctx->wfsz;
+
+            ngx_http_nphase_add_range_singlepart_header(r, pr_ctx);
+        }
+        
+        return ngx_http_next_header_filter(r);
+    }else{
+        /* sub request */
+        sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+        
+        if (! sr_ctx) {
+            return ngx_http_next_header_filter(r);
+        }
+
+        if (! r->parent) {
+            return ngx_http_next_header_filter(r);
+        }
+        
+        pr_ctx = ngx_http_get_module_ctx(r->parent, ngx_http_nphase_module);
+        
+        if (! pr_ctx) {
+            return ngx_http_next_header_filter(r);
+        }
+
+        ngx_http_nphase_balance_header(pr_ctx, sr_ctx);
+
+        if (sr_ctx->seg) {
+            return ngx_http_nphase_prefetch_header(r, pr_ctx, sr_ctx);
+        }
+
+        if (pr_ctx->body_ready) {
+            return NGX_OK;
+        }
+
+        if ((r->headers_out.status == NGX_HTTP_NOT_FOUND
+             || r->headers_out.status == NGX_HTTP_GONE)
+            && !pr_ctx->fetching
+            && !pr_ctx->header_sent)
+        {
+            /* phase 1 of a file that does not exist */
+            ngx_http_nphase_neg_cache_insert(r->parent, pr_ctx,
+                                             r->headers_out.status);
+        }
+
+        if (r->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE 
+            && r->headers_out.status != NGX_HTTP_MOVED_TEMPORARILY ) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (r->headers_out.status == NGX_HTTP_MOVED_TEMPORARILY ) {
+            if (ngx_http_nphase_process_header(r, pr_ctx) == NGX_ERROR
+                    && pr_ctx->wfsz == 0) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (!pr_ctx->header_sent) {
+                ngx_http_nphase_process_validators(r, pr_ctx);
+            }
+
+            rc = ngx_http_nphase_parse_location(r, &pr_ctx->loc_body_c,
+                                                &pr_ctx->loc_buf);
+
+            if (rc == NGX_DECLINED) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase get 302 from upstream without location string");
+                return NGX_ERROR;
+            }
+
+            if (rc != NGX_OK) {
+                return NGX_ERROR;
+            }
+            
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                            "nphase get next phase loc: %V", 
+                            &pr_ctx->loc_body_c);
+
+            if (ngx_http_nphase_loc_cache_insert(r->parent, &pr_ctx->loc_key,
+                                                 &pr_ctx->loc_body_c,
+                                                 pr_ctx->wfsz, &pr_ctx->etag,
+                                                 pr_ctx->last_modified)
+                == NGX_OK)
+            {
+                /* the entry took the place of the lock */
+                pr_ctx->loc_locked = 0;
+            }
+
+            ngx_http_nphase_loc_cache_unlock(r->connection->log, pr_ctx);
+
+            ngx_http_nphase_parse_segment_map(r, pr_ctx);
+            ngx_http_nphase_parse_replicas(r, pr_ctx);
+
+            if (pr_ctx->balance && pr_ctx->replicas.len) {
+                /* Location is the first of the replicas, take the best */
+                (void) ngx_http_nphase_replica_next(pr_ctx,
+                                                    &pr_ctx->loc_body_c);
+            }
+
+            pr_ctx->loc_end = -1;
+
+            if (ngx_http_nphase_segment_range(r, &start, &end) == NGX_OK) {
+                pr_ctx->loc_end = end;
+
+                if (pr_ctx->multipart) {
+                    (void) ngx_http_nphase_extent_push(r, pr_ctx, start, end,
+                                                       &pr_ctx->loc_body_c, 1);
+                }
+            }
+            
+            pr_ctx->loc_ready = 1;
+            return NGX_OK;
+        }
+
+        /* upstream return 20x */
+
+        /* phase 1 answering with data was not asked for a fetch range */
+
+        if (pr_ctx->fetching
+            && r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT
+            && ngx_http_nphase_content_range(r, &cr) == NGX_OK
+            && (cr.start != pr_ctx->fetch_start || cr.end > pr_ctx->fetch_end))
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "nphase unexpected content range %O-%O, "
+                          "asked for %O-%O", cr.start, cr.end,
+                          pr_ctx->fetch_start, pr_ctx->fetch_end);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (pr_ctx->hedge_won) {
+            /* the hedge answered first, this one gives way */
+            return NGX_ERROR;
+        }
+
+        pr_ctx->body_ready = 1;
+
+        ngx_http_nphase_hedge_stop(r->parent, pr_ctx);
+
+        ngx_http_nphase_multipart_next(r, pr_ctx);
+
+        npcf = ngx_http_get_module_loc_conf(r->main, ngx_http_nphase_module);
+
+        if (npcf->prefetch_at
+            && r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT
+            && ngx_http_nphase_content_range(r, &cr) == NGX_OK)
+        {
+            /* the body filter looks up the next segment later */
+            pr_ctx->prefetch_at = (cr.end - cr.start + 1 - pr_ctx->fetch_skip)
+                                  * (off_t) npcf->prefetch_at / 100;
+
+            if (pr_ctx->prefetch_at == 0) {
+                pr_ctx->prefetch_at = 1;
+            }
+
+        } else {
+            ngx_http_nphase_prefetch_next(r, pr_ctx);
+        }
+        return NGX_OK;
+    }
+    
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    off_t                            size;
+    ngx_int_t                        rc;
+    ngx_chain_t                     *cl, *ln, *own;
+    ngx_http_nphase_seg_t           *seg;
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+    ngx_http_nphase_ctx_t           *pr_ctx;
+    
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase body filter status:%d", 
+                   r->headers_out.status);
+    
+    if (r == r->main) {
+        /* parent request */
+        pr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+        if (! pr_ctx) {
+            return ngx_http_next_body_filter(r, in);
+        }
+        
+        if (pr_ctx->sr_error 
+            && r->headers_out.status < NGX_HTTP_SPECIAL_RESPONSE) 
+        {
+            return ngx_http_next_body_filter(r, NULL);
+        }
+
+        if (pr_ctx->part_pending && in) {
+            /* first data of a part, put the part header in front */
+            cl = ngx_http_nphase_multipart_part(r, pr_ctx);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            pr_ctx->part_pending = 0;
+
+            for (ln = cl; ln->next; ln = ln->next) { /* void */ }
+
+            ln->next = in;
+            in = cl;
+        }
+        
+        return ngx_http_next_body_filter(r, in);
+    }else{
+        sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+        
+        if (!sr_ctx) {
+            return ngx_http_next_body_filter(r, in);
+        }
+    
+        if (! r->parent) {
+            return ngx_http_next_body_filter(r, in);
+        }
+        
+        pr_ctx = ngx_http_get_module_ctx(r->parent, ngx_http_nphase_module);
+        
+        if (! pr_ctx) {
+            return ngx_http_next_body_filter(r, in);
+        }
+
+        if (sr_ctx->seg) {
+            seg = sr_ctx->seg;
+
+            if (sr_ctx->phase == 1 
+                || seg->discard 
+                || seg->state == NGX_HTTP_NPHASE_SEG_ERROR) 
+            {
+                ngx_http_nphase_discard_bufs(r->pool, in);
+                return NGX_OK;
+            }
+
+            size = 0;
+            for (cl = in; cl; cl = cl->next) {
+                size += ngx_buf_size(cl->buf);
+            }
+
+            seg->received += size;
+
+            if (seg->promoted) {
+                return ngx_http_output_filter(r->parent, in);
+            }
+
+            /* hold the body until the segment becomes current */
+            seg->held += size;
+            pr_ctx->prefetch_held += size;
+
+            if (ngx_chain_add_copy(r->parent->pool, &seg->out, in) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_OK;
+        }
+
+        if (! pr_ctx->body_ready) {
+            return NGX_OK;
+        }
+
+        own = NULL;
+
+        if (pr_ctx->fetch_skip) {
+            /* the front of the block is not in the client's range */
+            in = ngx_http_nphase_align_skip(r, pr_ctx, in);
+
+            if (in == NGX_CHAIN_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (in == NULL) {
+                return NGX_OK;
+            }
+
+            own = in;
+        }
+
+        if (pr_ctx->steal_cut) {
+            /* the rest of the range went to a replica */
+            in = ngx_http_nphase_steal_trim(r, pr_ctx, sr_ctx, in);
+
+            ngx_http_nphase_free_links(r->pool, own);
+
+            if (in == NGX_CHAIN_ERROR) {
+                return NGX_ERROR;
+            }
+
+            own = in;
+
+            if (in == NULL) {
+                return NGX_OK;
+            }
+        }
+
+        for (cl = in; cl; cl = cl->next) {
+            sr_ctx->received += ngx_buf_size(cl->buf);
+        }
+
+        if (pr_ctx->prefetch_at && sr_ctx->received >= pr_ctx->prefetch_at) {
+            /* far enough into the segment, look up the next one */
+            pr_ctx->prefetch_at = 0;
+            ngx_http_nphase_prefetch_next(r, pr_ctx);
+        }
+
+        ngx_http_nphase_steal_check(r, pr_ctx, sr_ctx);
+        
+        if (! pr_ctx->header_sent){
+            pr_ctx->pr_status = r->headers_out.status;
+
+            if (r->parent->headers_out.content_length_n == -1) {
+                r->parent->headers_out.content_length_n = 
+                    r->headers_out.content_length_n;
+            }
+            
+            if (ngx_http_send_header(r->parent) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+
+        rc = ngx_http_output_filter(r->parent, in);
+
+        /* the filters keep copies of the links, ours are reused */
+        ngx_http_nphase_free_links(r->pool, own);
+
+        return rc;
+    }
+}
+
+void
+ngx_http_nphase_discard_bufs(ngx_pool_t *pool, ngx_chain_t *in)
+{
+    ngx_chain_t         *cl;
+
+    for (cl = in; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->last;
+        cl->buf->file_pos = cl->buf->file_last;
+    }
+}
+
+static char *
+ngx_http_nphase_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_str_t        *value;
+
+    if (npcf->uri.data != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        npcf->uri.len = 0;
+        npcf->uri.data = (u_char *) "";
+
+        return NGX_CONF_OK;
+    }
+
+    npcf->uri = value[1];
+
+    /* register content phase handler */
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    if (clcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    
+    clcf->handler = ngx_http_nphase_content_handler;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_nphase_set_uri_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+    ngx_str_t                   *value;
+    
+    value = cf->args->elts;
+
+    if (value[1].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    value[1].len--;
+    value[1].data++;
+
+    npcf->uri_var_index = ngx_http_get_variable_index(cf, &value[1]);
+    if (npcf->uri_var_index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_nphase_set_range_var(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+    ngx_str_t                   *value;
+    
+    value = cf->args->elts;
+
+    if (value[1].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    value[1].len--;
+    value[1].data++;
+
+    npcf->range_var_index = ngx_http_get_variable_index(cf, &value[1]);
+    if (npcf->range_var_index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t
+ngx_http_nphase_range_update(ngx_http_request_t *r, ngx_int_t index, 
+                                            off_t start, off_t end, ngx_int_t flag)
+{
+    u_char                            *p;
+    ngx_http_nphase_ctx_t             *ctx;
+    ngx_http_variable_value_t         *var;
+    
+    /* the previous subrequest has taken its copy already */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ctx->range_buf;
+
+    if (flag == 0) {
+        p = ngx_sprintf(p, "bytes=%O-%O", start, end);
+    } else if (flag == 1) {
+        p = ngx_sprintf(p, "bytes=%O-", start);
+    } else if (flag == 2) {
+        p = ngx_sprintf(p, "bytes=-%O", end);
+    } else if (flag == -1) {
+        p = ngx_sprintf(p, "bytes=0-");
+    } else {
+        return NGX_ERROR;
+    }
+
+    ctx->sr_range.data = ctx->range_buf;
+    ctx->sr_range.len = p - ctx->range_buf;
+
+    if (index == -1) {
+        /* $nphase_range only */
+        return NGX_OK;
+    }
+
+    var = ngx_http_get_indexed_variable(r, index);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->data = ctx->sr_range.data;
+    var->len = ctx->sr_range.len;
+    
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_uri_update(ngx_http_request_t *r, ngx_int_t index,
+    ngx_str_t *uri)
+{
+    ngx_http_nphase_ctx_t             *ctx;
+    ngx_http_variable_value_t         *var;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->sr_uri = *uri;
+
+    if (index == -1) {
+        /* $nphase_uri only */
+        return NGX_OK;
+    }
+
+    var = ngx_http_get_indexed_variable(r, index);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->data = uri->data;
+    var->len = uri->len;
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_nphase_range_parse(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    u_char            *p;
+    off_t              start, end;
+    ngx_int_t          flag;
+    ngx_uint_t         suffix;
+    ngx_http_nphase_range_t  *range;
+
+    p = r->headers_in.range->value.data + 6;
+
+    for ( ;; ) {
+        start = 0;
+        end = 0;
+        suffix = 0;
+        flag = 0;
+
+        while (*p == ' ') { p++; }
+
+        if (*p != '-') {
+            if (*p < '0' || *p > '9') {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
+
+            while (*p >= '0' && *p <= '9') {
+                start = start * 10 + *p++ - '0';
+            }
+
+            while (*p == ' ') { p++; }
+
+            if (*p++ != '-') {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
+
+            while (*p == ' ') { p++; }
+
+            if (*p == ',' || *p == '\0') {
+                range = ngx_array_push(&ctx->range_in);
+                if (range == NULL) {
+                    return NGX_ERROR;
+                }
+
+                range->start = start;
+                range->end = end;
+                range->flag = 1;
+
+                if (*p++ != ',') {
+                    return NGX_OK;
+                }
+
+                continue;
+            }
+
+        } else {
+            suffix = 1;
+            p++;
+        }
+
+        if (*p < '0' || *p > '9') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        while (*p >= '0' && *p <= '9') {
+            end = end * 10 + *p++ - '0';
+        }
+
+        while (*p == ' ') { p++; }
+
+        if (*p != ',' && *p != '\0') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        if (suffix) {
+            flag = 2;
+        }
+
+        if (start > end && flag != 1) {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        range = ngx_array_push(&ctx->range_in);
+        if (range == NULL) {
+            return NGX_ERROR;
+        }
+
+        range->start = start;
+        range->end = end;
+        range->flag = flag;
+
+        if (*p++ != ',') {
+            return NGX_OK;
+        }
+    }
+}
+
+
+ngx_int_t
+ngx_http_nphase_content_range_parse(u_char *p, ngx_http_nphase_range_t *range)
+{
+    off_t              start, end, length;
+    ngx_uint_t         suffix;
+
+    start = 0;
+    end = 0;
+    length = 0;
+    suffix = 0;
+
+    while (*p == ' ') { p++; }
+
+    if (*p != '-') {
+        if (*p < '0' || *p > '9') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        while (*p >= '0' && *p <= '9') {
+            start = start * 10 + *p++ - '0';
+        }
+
+        while (*p == ' ') { p++; }
+
+        if (*p++ != '-') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        while (*p == ' ') { p++; }
+
+        if (*p == ',' || *p == '\0') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+    } else {
+        suffix = 1;
+        p++;
+    }
+
+    if (*p < '0' || *p > '9') {
+        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+    }
+
+    while (*p >= '0' && *p <= '9') {
+        end = end * 10 + *p++ - '0';
+    }
+    if (start > end) {
+        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+    }
+    if (!suffix) {
+       range->start = start;
+    }
+    range->end = end;
+
+    while (*p == ' ') { p++; }
+
+    if (*p != '/') {
+        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+    }
+    p++;
+    
+    if (*p < '0' || *p > '9') {
+        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+    }
+    while (*p >= '0' && *p <= '9') {
+        length = length * 10 + *p++ - '0';
+    }
+    range->length = length;
+    if (*p++ != ',') {
+        return NGX_OK;
+    }
+    return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+}
+
+
+ngx_int_t
+ngx_http_nphase_copy_header_value(ngx_list_t *headers, ngx_str_t *k, ngx_str_t *v)
+{
+    ngx_uint_t          n;
+    ngx_table_elt_t     *ho;
+    u_char              *p;
+    size_t              len = 0;
+
+    for (n = 0; n < headers->part.nelts; n++) {
+        ho = &((ngx_table_elt_t *)headers->part.elts)[n];
+        if (ngx_strncmp(ho->key.data, k->data, k->len) == 0) {
+
+            len += ho->value.len;
+            p = ngx_palloc(headers->pool, len + 1);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+            
+            v->data = p;
+            v->len = len;
+            p = ngx_copy(p, ho->value.data, ho->value.len);
+            *p = '\0';
+            
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_nphase_run_subrequest(ngx_http_request_t *r, 
+                                            ngx_http_nphase_ctx_t *ctx,
+                                            ngx_str_t *uri,
+                                            ngx_str_t *args)
+{
+    ngx_int_t                        rc;
+    ngx_http_nphase_peer_t           peer;
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+    ngx_http_request_t              *sr;
+
+    ctx->ps.handler = ngx_http_nphase_subrequest_done;
+    ctx->ps.data = ctx;
+    ctx->sr_done = 0;
+
+    rc = ngx_http_nphase_peer_lookup(r, ctx, &ctx->sr_uri, &peer);
+
+    if (rc == NGX_AGAIN) {
+        /* started again by the access handler once the name resolved */
+        ctx->sr_pending = 1;
+        return NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_subrequest(r, uri, args, &sr, &ctx->ps,
+                            NGX_HTTP_SUBREQUEST_WAITED)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    sr_ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_nphase_sub_ctx_t));
+    if (sr_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_http_set_ctx(sr, sr_ctx, ngx_http_nphase_module);
+
+    /* keep this subrequest's values for $nphase_uri and $nphase_range */
+    sr_ctx->uri = ctx->sr_uri;
+    sr_ctx->range = ctx->sr_range;
+    sr_ctx->peer = peer;
+    sr_ctx->phase = ctx->fetching ? 2 : 1;
+
+    if (ctx->fetching
+        && (ctx->reserved
+            || ngx_http_nphase_balance_reserve(ctx, &sr_ctx->uri, 0)
+               == NGX_OK))
+    {
+        ctx->reserved = 0;
+        ngx_http_nphase_balance_begin(ctx, sr_ctx);
+    }
+
+    ctx->sr_fg = sr;
+    ctx->sr_count++;
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_nphase_process_header(ngx_http_request_t *r, 
+                                            ngx_http_nphase_ctx_t *ctx)
+{
+    off_t               fsz;
+    u_char              *p;
+    size_t              len;
+    ngx_str_t           val;
+    ngx_str_t           key = ngx_string("X-NP-File-Size");
+    
+    if (ngx_http_nphase_copy_header_value(
+            &r->headers_out.headers, &key, &val) == NGX_OK) 
+    {
+        fsz = 0;
+        len = val.len;
+        p = val.data;
+        for ( ;; ) {
+
+            while (*p == ' ') { 
+                if (fsz != 0) {
+                    return NGX_ERROR;
+                }
+                p++; 
+                len--; 
+            }
+
+            if (*p < '0' || *p > '9') {
+                return NGX_ERROR;
+            }
+            
+            fsz = fsz * 10 + *p++ - '0';
+            len--;
+            if (len == 0) {
+                ctx->wfsz = fsz;
+                break;
+            }
+        }
+    }
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_process_validators(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_str_t           val;
+    ngx_str_t           etag = ngx_string("ETag");
+    ngx_str_t           lm = ngx_string("Last-Modified");
+
+    /* validators of the file, if the metadata server gives them */
+
+    if (r->headers_out.etag) {
+        ctx->etag = r->headers_out.etag->value;
+
+    } else if (ngx_http_nphase_copy_header_value(
+                   &r->headers_out.headers, &etag, &val) == NGX_OK)
+    {
+        ctx->etag = val;
+    }
+
+    if (r->headers_out.last_modified) {
+        val = r->headers_out.last_modified->value;
+
+    } else if (ngx_http_nphase_copy_header_value(
+                   &r->headers_out.headers, &lm, &val) != NGX_OK)
+    {
+        return;
+    }
+
+    ctx->last_modified = ngx_parse_http_time(val.data, val.len);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_add_validators(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_table_elt_t   *etag;
+
+    if (ctx->last_modified != -1) {
+        r->headers_out.last_modified_time = ctx->last_modified;
+    }
+
+    if (ctx->etag.len == 0) {
+        return NGX_OK;
+    }
+
+    etag = ngx_list_push(&r->headers_out.headers);
+    if (etag == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->headers_out.etag = etag;
+
+    etag->hash = 1;
+    ngx_str_set(&etag->key, "ETag");
+    etag->value = ctx->etag;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_not_modified(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    u_char             *p, *last, *tag;
+    size_t              len;
+    time_t              ims;
+    ngx_str_t           etag;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_DECLINED;
+    }
+
+    if (r->headers_in.if_none_match) {
+
+        /* weak comparison, If-Modified-Since is not looked at then */
+
+        etag = ctx->etag;
+
+        if (etag.len > 2 && etag.data[0] == 'W' && etag.data[1] == '/') {
+            etag.data += 2;
+            etag.len -= 2;
+        }
+
+        p = r->headers_in.if_none_match->value.data;
+        last = p + r->headers_in.if_none_match->value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+                p++;
+            }
+
+            tag = p;
+
+            while (p < last && *p != ' ' && *p != '\t' && *p != ',') {
+                p++;
+            }
+
+            len = p - tag;
+
+            if (len == 1 && *tag == '*') {
+                return NGX_OK;
+            }
+
+            if (len > 2 && tag[0] == 'W' && tag[1] == '/') {
+                tag += 2;
+                len -= 2;
+            }
+
+            if (len && len == etag.len
+                && ngx_strncmp(tag, etag.data, len) == 0)
+            {
+                return NGX_OK;
+            }
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (r->headers_in.if_modified_since && ctx->last_modified != -1) {
+        ims = ngx_parse_http_time(r->headers_in.if_modified_since->value.data,
+                                  r->headers_in.if_modified_since->value.len);
+
+        if (ims != NGX_ERROR && ims >= ctx->last_modified) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+
+static ngx_int_t
+ngx_http_nphase_parse_location(ngx_http_request_t *r, ngx_str_t *loc,
+    ngx_http_nphase_strbuf_t *buf)
+{
+    ngx_str_t           val;
+    ngx_str_t           key = ngx_string("Location");
+
+    if (r->headers_out.location) {
+        val = r->headers_out.location->value;
+
+    } else if (ngx_http_nphase_copy_header_value(
+                   &r->headers_out.headers, &key, &val) != NGX_OK) 
+    {
+        return NGX_DECLINED;
+    }
+
+    if (val.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    return ngx_http_nphase_absolute_location(r, &val, loc, buf);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_absolute_location(ngx_http_request_t *r, ngx_str_t *val,
+    ngx_str_t *loc, ngx_http_nphase_strbuf_t *buf)
+{
+    u_char              *p;
+    size_t              len = 0;
+
+    /* a relative location is on the metadata server itself */
+
+    if (val->data[0] == '/') {
+        if (r->upstream == NULL || r->upstream->resolved == NULL) {
+            return NGX_DECLINED;
+        }
+
+        len += r->upstream->schema.len;
+        len += r->upstream->resolved->host.len;
+        if (len == 0) {
+            return NGX_DECLINED;
+        }
+    }
+
+    len += val->len;
+    p = ngx_http_nphase_reserve(r->pool, buf, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    loc->data = p;
+    loc->len = len;
+
+    if (val->data[0] == '/') {
+        p = ngx_copy(p, r->upstream->schema.data, r->upstream->schema.len);
+        p = ngx_copy(p, r->upstream->resolved->host.data, 
+                        r->upstream->resolved->host.len);
+    }
+
+    ngx_memcpy(p, val->data, val->len);
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_nphase_reserve(ngx_pool_t *pool, ngx_http_nphase_strbuf_t *buf,
+    size_t len)
+{
+    if (buf == NULL) {
+        return ngx_pnalloc(pool, len);
+    }
+
+    if (buf->size < len) {
+        buf->data = ngx_pnalloc(pool, len);
+        if (buf->data == NULL) {
+            buf->size = 0;
+            return NULL;
+        }
+
+        buf->size = len;
+    }
+
+    return buf->data;
+}
+
+
+static ngx_http_nphase_range_t *
+ngx_http_nphase_range_cur(ngx_http_nphase_ctx_t *ctx)
+{
+    return (ngx_http_nphase_range_t *) ctx->range_in.elts + ctx->part;
+}
+
+
+static ngx_uint_t
+ngx_http_nphase_range_pending(ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_http_nphase_range_t         *rin;
+
+    rin = ngx_http_nphase_range_cur(ctx);
+
+    return (rin->flag == -1 && ctx->range_sent.end < ctx->wfsz)
+           || ctx->range_sent.end < rin->end - rin->start + 1;
+}
+
+
+static off_t
+ngx_http_nphase_range_last(ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_http_nphase_range_t         *rin;
+
+    rin = ngx_http_nphase_range_cur(ctx);
+
+    if (rin->flag == 0 && (ctx->wfsz == 0 || rin->end < ctx->wfsz)) {
+        return rin->end;
+    }
+
+    return ctx->wfsz - 1;
+}
+
+
+static off_t
+ngx_http_nphase_range_next_end(ngx_http_nphase_ctx_t *ctx)
+{
+    off_t                            end, offset;
+    ngx_queue_t                     *q;
+    ngx_http_nphase_seg_t           *seg;
+    ngx_http_nphase_range_t         *rin;
+
+    rin = ngx_http_nphase_range_cur(ctx);
+    end = rin->end ? rin->end : ctx->wfsz;
+
+    if (ngx_queue_empty(&ctx->prefetch)) {
+        return end;
+    }
+
+    /* stop in front of the next prefetched stripe */
+
+    offset = rin->start + ctx->range_sent.end;
+
+    q = ngx_queue_head(&ctx->prefetch);
+    seg = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+    if (seg->part == ctx->part && seg->start > offset && seg->start - 1 < end) {
+        end = seg->start - 1;
+    }
+
+    return end;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_content_range(ngx_http_request_t *r,
+    ngx_http_nphase_range_t *cr)
+{
+    ngx_str_t                        val;
+    ngx_str_t                        key = ngx_string("Content-Range");
+
+    if (ngx_http_nphase_copy_header_value(&r->headers_out.headers, &key, &val)
+            != NGX_OK
+        || val.len < 6
+        || ngx_strncasecmp(val.data, (u_char *) "bytes ", 6) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(cr, sizeof(ngx_http_nphase_range_t));
+
+    if (ngx_http_nphase_content_range_parse(val.data + 6, cr) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_loc_host(ngx_str_t *loc, ngx_str_t *host)
+{
+    u_char  *p, *last;
+
+    /* "scheme://host:port/path" -> "host:port" */
+
+    p = loc->data;
+    last = loc->data + loc->len;
+
+    host->data = ngx_strlcasestrn(p, last, (u_char *) "://", 3 - 1);
+
+    if (host->data == NULL) {
+        host->data = p;
+
+    } else {
+        host->data += 3;
+    }
+
+    p = ngx_strlchr(host->data, last, '/');
+
+    host->len = (p ? p : last) - host->data;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_str_t                       *value;
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+
+    sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+    if (r == r->main || sr_ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    value = (ngx_str_t *) ((char *) sr_ctx + data);
+
+    if (value->len == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = value->len;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = value->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_cache_key_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                          *p;
+    size_t                           len;
+    ngx_str_t                       *host;
+    ngx_http_nphase_ctx_t           *ctx;
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+
+    sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_nphase_module);
+
+    if (r == r->main || sr_ctx == NULL || sr_ctx->range.len == 0
+        || ctx == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    /*
+     * "phase range host metadata-uri validator": the file and its bytes,
+     * not the chunk server, so that the replicas of a segment share one
+     * entry; the metadata uri carries the args, the validator of phase 2
+     * is the ETag or else the whole file size, a new version misses
+     */
+
+    host = &r->main->headers_in.server;
+
+    len = sizeof("2 ") - 1 + sr_ctx->range.len + 1 + host->len + 1
+          + ctx->uri_var_value.len + 1;
+
+    if (sr_ctx->phase == 2) {
+        len += ngx_max(ctx->etag.len, NGX_OFF_T_LEN);
+    }
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    p = ngx_sprintf(p, "%ui %V %V %V", (ngx_uint_t) sr_ctx->phase,
+                    &sr_ctx->range, host, &ctx->uri_var_value);
+
+    if (sr_ctx->phase == 2) {
+        if (ctx->etag.len) {
+            p = ngx_sprintf(p, " %V", &ctx->etag);
+
+        } else {
+            p = ngx_sprintf(p, " %O", ctx->wfsz);
+        }
+    }
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_nphase_add_range_singlepart_header(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_table_elt_t   *content_range;
+    ngx_http_nphase_range_t         *rin;
+    ngx_http_nphase_range_t         range;
+
+    rin = ngx_http_nphase_range_cur(ctx);
+    if (rin->flag == -1) {
+        return NGX_OK;
+    }
+
+    content_range = ngx_list_push(&r->headers_out.headers);
+    if (content_range == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->headers_out.content_range = content_range;
+
+    content_range->hash = 1;
+    ngx_str_set(&content_range->key, "Content-Range");
+
+    content_range->value.data = ngx_pnalloc(r->pool,
+                                    sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
+    if (content_range->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* "Content-Range: bytes SSSS-EEEE/TTTT" header */
+
+    if (rin->flag == 0) {
+        range.start = rin->start;
+        range.end = rin->end;
+    } else if (rin->flag == 1) {
+        range.start = rin->start;
+        range.end = r->headers_out.content_length_n - 1;
+    } else if (rin->flag == 2) {
+        range.start = r->headers_out.content_length_n - rin->end;
+        range.end = r->headers_out.content_length_n - 1;
+    } else {
+        return NGX_ERROR;
+    }
+
+    content_range->value.len = ngx_sprintf(content_range->value.data,
+                                           "bytes %O-%O/%O",
+                                           range.start, range.end,
+                                           r->headers_out.content_length_n)
+                               - content_range->value.data;
+    
+    r->headers_out.content_length_n = range.end - range.start + 1;
+
+    if (r->headers_out.content_length) {
+        r->headers_out.content_length->hash = 0;
+        r->headers_out.content_length = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_add_range_multipart_header(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    off_t                            len;
+    size_t                           size;
+    ngx_str_t                       *type;
+    ngx_uint_t                       i;
+    ngx_http_nphase_range_t         *range;
+
+    static ngx_str_t  default_type = ngx_string("application/octet-stream");
+
+    /* the parts carry the type of the file, the chunk server tells it */
+
+    if (ctx->content_type.len) {
+        type = &ctx->content_type;
+
+    } else if (r->headers_out.content_type.len) {
+        type = &r->headers_out.content_type;
+
+    } else {
+        type = &default_type;
+    }
+
+    size = sizeof(CRLF "--") - 1 + NGX_ATOMIC_T_LEN
+           + sizeof(CRLF "Content-Type: ") - 1 + type->len
+           + sizeof(CRLF "Content-Range: bytes ") - 1;
+
+    ctx->boundary_header.data = ngx_pnalloc(r->pool, size);
+    if (ctx->boundary_header.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->boundary = ngx_next_temp_number(0);
+
+    /*
+     * The boundary header of the range:
+     * CRLF
+     * "--0123456789" CRLF
+     * "Content-Type: image/jpeg" CRLF
+     * "Content-Range: bytes "
+     */
+
+    ctx->boundary_header.len = ngx_sprintf(ctx->boundary_header.data,
+                                           CRLF "--%0muA" CRLF
+                                           "Content-Type: %V" CRLF
+                                           "Content-Range: bytes ",
+                                           ctx->boundary, type)
+                               - ctx->boundary_header.data;
+
+    r->headers_out.content_type.data = 
+        ngx_pnalloc(r->pool,
+                    sizeof("multipart/byteranges; boundary=") - 1
+                    + NGX_ATOMIC_T_LEN);
+
+    if (r->headers_out.content_type.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->headers_out.content_type.len = 
+        ngx_sprintf(r->headers_out.content_type.data,
+                    "multipart/byteranges; boundary=%0muA",
+                    ctx->boundary)
+        - r->headers_out.content_type.data;
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+    r->headers_out.charset.len = 0;
+
+    /* the size of the last boundary CRLF "--0123456789--" CRLF */
+
+    len = sizeof(CRLF "--") - 1 + NGX_ATOMIC_T_LEN + sizeof("--" CRLF) - 1;
+
+    range = ctx->range_in.elts;
+
+    for (i = 0; i < ctx->range_in.nelts; i++) {
+
+        /* the size of the range: "SSSS-EEEE/TTTT" CRLF CRLF */
+
+        range[i].range.data = ngx_pnalloc(r->pool,
+                                   3 * NGX_OFF_T_LEN + 2 + 4);
+        if (range[i].range.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        range[i].range.len = ngx_sprintf(range[i].range.data,
+                                         "%O-%O/%O" CRLF CRLF,
+                                         range[i].start, range[i].end,
+                                         ctx->wfsz)
+                             - range[i].range.data;
+
+        len += ctx->boundary_header.len + range[i].range.len
+               + range[i].end - range[i].start + 1;
+    }
+
+    r->headers_out.content_length_n = len;
+
+    if (r->headers_out.content_length) {
+        r->headers_out.content_length->hash = 0;
+        r->headers_out.content_length = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_multipart_init(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_uint_t                       i, n, first;
+    ngx_http_nphase_range_t         *range;
+
+    ctx->parts_resolved = 1;
+
+    if (ctx->wfsz == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase multipart range request without file size");
+        return NGX_ERROR;
+    }
+
+    /* turn every part into "start-end" and drop the unsatisfiable ones */
+
+    range = ctx->range_in.elts;
+    n = 0;
+    first = 1;
+
+    for (i = 0; i < ctx->range_in.nelts; i++) {
+
+        if (range[i].flag == 2) {
+            range[i].start = (range[i].end < ctx->wfsz) 
+                             ? ctx->wfsz - range[i].end : 0;
+            range[i].end = ctx->wfsz - 1;
+
+        } else if (range[i].flag == 1 || range[i].end >= ctx->wfsz) {
+            range[i].end = ctx->wfsz - 1;
+        }
+
+        range[i].flag = 0;
+
+        if (range[i].start >= ctx->wfsz) {
+            if (i == 0) {
+                /* the part that was looked up is not sent */
+                first = 0;
+            }
+
+            continue;
+        }
+
+        range[n++] = range[i];
+    }
+
+    if (n == 0) {
+        return NGX_DECLINED;
+    }
+
+    ctx->range_in.nelts = n;
+
+    if (n == 1) {
+        ctx->multipart = 0;
+
+    } else {
+        ctx->part_pending = 1;
+    }
+
+    return first ? NGX_OK : NGX_AGAIN;
+}
+
+
+static void
+ngx_http_nphase_multipart_next(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_uint_t                       i;
+    ngx_http_request_t              *pr;
+    ngx_http_nphase_seg_t           *seg;
+    ngx_http_nphase_range_t         *range;
+
+    if (!ctx->multipart) {
+        return;
+    }
+
+    pr = r->parent;
+
+    if (ctx->content_type.len == 0) {
+        ctx->content_type = r->headers_out.content_type;
+    }
+
+    ngx_http_nphase_extent_add(r, ctx, &ctx->loc_body_c);
+
+    if (ctx->parts_started) {
+        return;
+    }
+
+    ctx->parts_started = 1;
+
+    /* the other parts are fetched in background and held until their turn */
+
+    range = ctx->range_in.elts;
+
+    for (i = 1; i < ctx->range_in.nelts; i++) {
+        seg = ngx_http_nphase_seg_alloc(pr, ctx);
+        if (seg == NULL) {
+            return;
+        }
+
+        seg->start = range[i].start;
+        seg->end = range[i].end;
+        seg->part = i;
+
+        ngx_http_nphase_prefetch_start(pr, ctx, seg);
+    }
+}
+
+
+static ngx_chain_t *
+ngx_http_nphase_multipart_part(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_buf_t                       *b;
+    ngx_chain_t                     *hcl, *rcl;
+    ngx_http_nphase_range_t         *rin;
+
+    rin = ngx_http_nphase_range_cur(ctx);
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->memory = 1;
+    b->pos = ctx->boundary_header.data;
+    b->last = ctx->boundary_header.data + ctx->boundary_header.len;
+
+    hcl = ngx_alloc_chain_link(r->pool);
+    if (hcl == NULL) {
+        return NULL;
+    }
+
+    hcl->buf = b;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->temporary = 1;
+    b->pos = rin->range.data;
+    b->last = rin->range.data + rin->range.len;
+
+    rcl = ngx_alloc_chain_link(r->pool);
+    if (rcl == NULL) {
+        return NULL;
+    }
+
+    rcl->buf = b;
+    rcl->next = NULL;
+    hcl->next = rcl;
+
+    return hcl;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_multipart_finish(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_buf_t                       *b;
+    ngx_chain_t                      out;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->temporary = 1;
+
+    b->pos = ngx_pnalloc(r->pool, sizeof(CRLF "--") - 1 + NGX_ATOMIC_T_LEN
+                                  + sizeof("--" CRLF) - 1);
+    if (b->pos == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->pos, CRLF "--%0muA--" CRLF, ctx->boundary);
+
+    out.buf = b;
+    out.next = NULL;
+
+    if (ngx_http_output_filter(r, &out) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_extent_add(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *loc)
+{
+    ngx_http_nphase_range_t          cr;
+
+    /* the chunk server at loc holds at least the bytes it answered */
+
+    if (loc->len == 0 || ngx_http_nphase_content_range(r, &cr) != NGX_OK) {
+        return;
+    }
+
+    (void) ngx_http_nphase_extent_push(r, ctx, cr.start, cr.end, loc, 1);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_extent_push(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    off_t start, off_t end, ngx_str_t *loc, ngx_uint_t copy)
+{
+    u_char                          *p;
+    ngx_http_nphase_extent_t        *ext;
+
+    if (ctx->extents && ctx->extents->nelts >= NGX_HTTP_NPHASE_MAX_EXTENTS) {
+        return NGX_DECLINED;
+    }
+
+    if (copy) {
+        /* loc is in a buffer reused by the next lookup */
+        p = ngx_pnalloc(r->pool, loc->len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, loc->data, loc->len);
+    
+    } else {
+        p = loc->data;
+    }
+
+    if (ctx->extents == NULL) {
+        ctx->extents = ngx_array_create(r->pool, 4, 
+                                        sizeof(ngx_http_nphase_extent_t));
+        if (ctx->extents == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ext = ngx_array_push(ctx->extents);
+    if (ext == NULL) {
+        return NGX_ERROR;
+    }
+
+    ext->start = start;
+    ext->end = end;
+    ext->loc.len = loc->len;
+    ext->loc.data = p;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase extent %O-%O: %V", start, end, loc);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_extent_find(ngx_http_nphase_ctx_t *ctx, off_t offset,
+    ngx_str_t *loc, off_t *end)
+{
+    ngx_int_t                        i;
+    ngx_http_nphase_extent_t        *ext;
+
+    i = ngx_http_nphase_extent_pick(ctx, offset, NULL);
+    if (i == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
+
+    ext = ctx->extents->elts;
+
+    *loc = ext[i].loc;
+    *end = ext[i].end;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_extent_drop(ngx_http_nphase_ctx_t *ctx, off_t offset,
+    ngx_str_t *loc)
+{
+    ngx_uint_t                       i;
+    ngx_http_nphase_extent_t        *ext;
+
+    if (ctx->extents == NULL) {
+        return;
+    }
+
+    ext = ctx->extents->elts;
+
+    for (i = 0; i < ctx->extents->nelts; i++) {
+        if (offset >= ext[i].start && offset <= ext[i].end
+            && ext[i].loc.len == loc->len
+            && ngx_strncmp(ext[i].loc.data, loc->data, loc->len) == 0)
+        {
+            /* never matches again, a replica of the segment may */
+            ext[i].end = -1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_nphase_segment_range(ngx_http_request_t *r, off_t *start, off_t *end)
+{
+    u_char                          *p, *last;
+    ngx_str_t                        val;
+    ngx_str_t                        key = ngx_string("X-NP-Segment-Range");
+
+    /* "X-NP-Segment-Range: 67108864-134217727", the segment of the location */
+
+    if (ngx_http_nphase_copy_header_value(&r->headers_out.headers, &key, &val)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    p = val.data;
+    last = val.data + val.len;
+
+    while (p < last && *p == ' ') { p++; }
+
+    if (p == last || *p < '0' || *p > '9') {
+        goto invalid;
+    }
+
+    *start = 0;
+    while (p < last && *p >= '0' && *p <= '9') {
+        *start = *start * 10 + *p++ - '0';
+    }
+
+    if (p == last || *p++ != '-' || p == last || *p < '0' || *p > '9') {
+        goto invalid;
+    }
+
+    *end = 0;
+    while (p < last && *p >= '0' && *p <= '9') {
+        *end = *end * 10 + *p++ - '0';
+    }
+
+    while (p < last && *p == ' ') { p++; }
+
+    if (p != last || *start > *end) {
+        goto invalid;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "nphase invalid segment range \"%V\"", &val);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_nphase_parse_segment_map(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    u_char                          *p, *last;
+    off_t                            start, end;
+    ngx_str_t                        val, s, loc;
+    ngx_str_t                        key = ngx_string("X-NP-Segment-Map");
+    ngx_uint_t                       n;
+
+    /*
+     * "X-NP-Segment-Map: 0-67108863 http://cs1/f 67108864-99999999 /cs2/f"
+     * one "start-end location[,replica...]" per segment, a replica is 
+     * one more extent of the same bytes found after the ones before it fail
+     */
+
+    if (ctx->seg_map) {
+        return;
+    }
+
+    if (ngx_http_nphase_copy_header_value(&r->headers_out.headers, &key, &val)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    ctx->seg_map = 1;
+
+    p = val.data;
+    last = val.data + val.len;
+    n = 0;
+
+    for ( ;; ) {
+        while (p < last && *p == ' ') { p++; }
+
+        if (p == last) {
+            break;
+        }
+
+        start = 0;
+        end = 0;
+
+        if (*p < '0' || *p > '9') {
+            goto invalid;
+        }
+
+        while (p < last && *p >= '0' && *p <= '9') {
+            start = start * 10 + *p++ - '0';
+        }
+
+        if (p == last || *p++ != '-' || p == last || *p < '0' || *p > '9') {
+            goto invalid;
+        }
+
+        while (p < last && *p >= '0' && *p <= '9') {
+            end = end * 10 + *p++ - '0';
+        }
+
+        if (start > end || p == last || *p != ' ') {
+            goto invalid;
+        }
+
+        while (p < last && *p == ' ') { p++; }
+
+        do {
+            if (p < last && *p == ',') {
+                p++;
+            }
+
+            s.data = p;
+
+            while (p < last && *p != ' ' && *p != ',') { p++; }
+
+            s.len = p - s.data;
+
+            if (s.len == 0) {
+                goto invalid;
+            }
+
+            if (ngx_http_nphase_absolute_location(r, &s, &loc, NULL) 
+                != NGX_OK
+                || ngx_http_nphase_extent_push(r, ctx, start, end, &loc, 0) 
+                   != NGX_OK)
+            {
+                return;
+            }
+
+        } while (p < last && *p == ',');
+
+        n++;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase segment map: %ui segments", n);
+
+    return;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "nphase invalid segment map \"%V\" at %ui", &val, n);
+}
+
+
+
+static char *
+ngx_http_nphase_location_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+
+    ssize_t                      size;
+    ngx_int_t                    ttl, lock, neg;
+    ngx_str_t                   *value, name, s;
+    ngx_uint_t                   i;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_http_nphase_loc_cache_t *cache;
+
+    if (npcf->loc_cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        npcf->loc_cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    size = 0;
+    ttl = NGX_HTTP_NPHASE_LOC_CACHE_TTL;
+    lock = 0;
+    neg = 0;
+    ngx_str_null(&name);
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+
+            if (name.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "lock_timeout=", 13) == 0) {
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            lock = ngx_parse_time(&s, 1);
+            if (lock == NGX_ERROR || lock == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "negative_ttl=", 13) == 0) {
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            neg = ngx_parse_time(&s, 1);
+            if (neg == NGX_ERROR || neg == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0) {
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            ttl = ngx_parse_time(&s, 1);
+            if (ttl == NGX_ERROR || ttl == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* size may be omitted if the zone is defined in another location */
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_nphase_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_nphase_loc_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone->init = ngx_http_nphase_loc_cache_init_zone;
+        shm_zone->data = cache;
+
+    } else if (shm_zone->init != ngx_http_nphase_loc_cache_init_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by nphase_balance",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    npcf->loc_cache_zone = shm_zone;
+    npcf->loc_cache_ttl = (time_t) ttl;
+    npcf->loc_cache_lock = (time_t) lock;
+    npcf->loc_cache_neg = (time_t) neg;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_loc_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_nphase_loc_cache_t  *ocache = data;
+
+    size_t                        len;
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_nphase_loc_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_nphase_loc_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    cache->sh->bloom_n = 0;
+    ngx_memzero(cache->sh->bloom, sizeof(cache->sh->bloom));
+
+    len = sizeof(" in nphase location cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in nphase location cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_loc_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_nphase_loc_node_t   *lcn, *lcnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lcn = (ngx_http_nphase_loc_node_t *) &node->color;
+            lcnt = (ngx_http_nphase_loc_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lcn->data, lcnt->data, lcn->len, lcnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_http_nphase_loc_node_t *
+ngx_http_nphase_loc_cache_find(ngx_http_nphase_loc_cache_t *cache,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_nphase_loc_node_t  *lcn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lcn = (ngx_http_nphase_loc_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, lcn->data, key->len, (size_t) lcn->len);
+
+        if (rc == 0) {
+            return lcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_nphase_loc_cache_remove(ngx_http_nphase_loc_cache_t *cache,
+    ngx_http_nphase_loc_node_t *lcn)
+{
+    ngx_rbtree_node_t  *node;
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) lcn - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_queue_remove(&lcn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, node);
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+
+static void
+ngx_http_nphase_loc_cache_expire(ngx_http_nphase_loc_cache_t *cache,
+    ngx_uint_t force)
+{
+    time_t                       now;
+    ngx_uint_t                   n;
+    ngx_queue_t                 *q;
+    ngx_http_nphase_loc_node_t  *lcn;
+
+    now = ngx_time();
+
+    /*
+     * n == 1 deletes one or two expired entries
+     * n == 0 deletes the oldest entry by force
+     *        and one or two expired entries
+     */
+
+    for (n = 0; n < 3; n++) {
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+
+        lcn = ngx_queue_data(q, ngx_http_nphase_loc_node_t, queue);
+
+        if ((n != 0 || !force) && lcn->expire > now) {
+            return;
+        }
+
+        ngx_http_nphase_loc_cache_remove(cache, lcn);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_nphase_loc_cache_lookup(ngx_http_request_t *r,
+    ngx_http_nphase_conf_t *npcf, ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_int_t  rc;
+
+    ctx->loc_cached = 0;
+    ctx->loc_stale = 0;
+    ctx->loc_end = -1;
+    ctx->loc_key.len = 0;
+    ctx->replicas.len = 0;
+
+    if (npcf->loc_cache_zone == NULL || ctx->loc_offset < 0) {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_nphase_loc_cache_key(r, ctx, ctx->loc_offset,
+                                       &ctx->loc_key);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    rc = ngx_http_nphase_loc_cache_get(r, &ctx->loc_key, &ctx->loc_body_c,
+                                       &ctx->wfsz, &ctx->loc_buf,
+                                       ctx->header_sent ? NULL : &ctx->etag,
+                                       &ctx->last_modified);
+    if (rc == NGX_OK) {
+        ctx->loc_cached = 1;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_loc_cache_key(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, off_t offset, ngx_str_t *key)
+{
+    u_char  *p;
+
+    /*
+     * "OOOO:HOST URI" with the evaluated metadata uri, args included;
+     * the host and the uri do not change within a request, so the
+     * buffer of a previous key has the same size
+     */
+
+    p = key->data;
+
+    if (p == NULL) {
+        p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN + 1
+                                 + r->headers_in.server.len + 1
+                                 + ctx->uri_var_value.len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        key->data = p;
+    }
+
+    key->len = ngx_sprintf(p, "%O:%V %V", offset, &r->headers_in.server,
+                           &ctx->uri_var_value)
+               - p;
+
+    if (key->len > 65535) {
+        key->len = 0;
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_loc_cache_get(ngx_http_request_t *r, ngx_str_t *key,
+    ngx_str_t *loc, off_t *wfsz, ngx_http_nphase_strbuf_t *buf,
+    ngx_str_t *etag, time_t *last_modified)
+{
+    u_char                       *p;
+    uint32_t                      hash;
+    ngx_http_nphase_conf_t       *npcf;
+    ngx_http_nphase_loc_node_t   *lcn;
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if (npcf->loc_cache_zone == NULL || key->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    cache = npcf->loc_cache_zone->data;
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lcn = ngx_http_nphase_loc_cache_find(cache, key, hash);
+
+    if (lcn == NULL || lcn->loc_len == 0) {
+        /* a lock is no location yet */
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    if (lcn->expire <= ngx_time()) {
+        ngx_http_nphase_loc_cache_remove(cache, lcn);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&lcn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &lcn->queue);
+
+    p = ngx_http_nphase_reserve(r->pool, buf, lcn->loc_len);
+    if (p == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, lcn->data + lcn->len, lcn->loc_len);
+
+    loc->data = p;
+    loc->len = lcn->loc_len;
+    *wfsz = lcn->wfsz;
+
+    if (etag && lcn->etag_len) {
+        p = ngx_pnalloc(r->pool, lcn->etag_len);
+        if (p == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, lcn->data + lcn->len + lcn->loc_len, lcn->etag_len);
+
+        etag->data = p;
+        etag->len = lcn->etag_len;
+    }
+
+    if (last_modified && lcn->last_modified != -1) {
+        *last_modified = lcn->last_modified;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase location cache hit: \"%V\" %V", key, loc);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_loc_cache_insert(ngx_http_request_t *r, ngx_str_t *key,
+    ngx_str_t *loc, off_t wfsz, ngx_str_t *etag, time_t last_modified)
+{
+    u_char                       *p;
+    size_t                        size, etag_len;
+    uint32_t                      hash;
+    ngx_rbtree_node_t            *node;
+    ngx_http_nphase_conf_t       *npcf;
+    ngx_http_nphase_loc_node_t   *lcn;
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if (npcf->loc_cache_zone == NULL
+        || key->len == 0
+        || loc->len == 0
+        || loc->len > 65535
+        || wfsz == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* a longer etag is not kept, conditions then go to phase 1 */
+    etag_len = (etag && etag->len <= 255) ? etag->len : 0;
+
+    cache = npcf->loc_cache_zone->data;
+    hash = ngx_crc32_short(key->data, key->len);
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_nphase_loc_node_t, data)
+           + key->len
+           + loc->len
+           + etag_len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lcn = ngx_http_nphase_loc_cache_find(cache, key, hash);
+    if (lcn) {
+        ngx_http_nphase_loc_cache_remove(cache, lcn);
+    }
+
+    node = ngx_http_nphase_loc_cache_alloc(cache, size);
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    node->key = hash;
+
+    lcn = (ngx_http_nphase_loc_node_t *) &node->color;
+
+    lcn->len = (u_short) key->len;
+    lcn->loc_len = (u_short) loc->len;
+    lcn->etag_len = (u_char) etag_len;
+    lcn->status = 0;
+    lcn->expire = ngx_time() + npcf->loc_cache_ttl;
+    lcn->last_modified = last_modified;
+    lcn->wfsz = wfsz;
+
+    p = ngx_cpymem(lcn->data, key->data, key->len);
+    p = ngx_cpymem(p, loc->data, loc->len);
+
+    if (etag_len) {
+        ngx_memcpy(p, etag->data, etag_len);
+    }
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &lcn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase location cache store: \"%V\"", key);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_loc_cache_delete(ngx_http_request_t *r, ngx_str_t *key)
+{
+    ngx_http_nphase_conf_t       *npcf;
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if (npcf->loc_cache_zone == NULL || key->len == 0) {
+        return;
+    }
+
+    cache = npcf->loc_cache_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_nphase_loc_cache_drop(cache, key);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase location cache drop: \"%V\"", key);
+}
+
+
+static void
+ngx_http_nphase_loc_cache_drop(ngx_http_nphase_loc_cache_t *cache,
+    ngx_str_t *key)
+{
+    ngx_http_nphase_loc_node_t   *lcn;
+
+    /* called with the zone locked */
+
+    lcn = ngx_http_nphase_loc_cache_find(cache, key,
+                                         ngx_crc32_short(key->data, key->len));
+    if (lcn) {
+        ngx_http_nphase_loc_cache_remove(cache, lcn);
+    }
+}
+
+
+static uint32_t
+ngx_http_nphase_bloom_bits(ngx_str_t *key, ngx_uint_t *bit)
+{
+    uint32_t                      hash, step;
+    ngx_uint_t                    i;
+
+    /* double hashing, the first hash is also the rbtree key */
+
+    hash = ngx_crc32_short(key->data, key->len);
+    step = ngx_murmur_hash2(key->data, key->len) | 1;
+
+    for (i = 0; i < NGX_HTTP_NPHASE_BLOOM_HASHES; i++) {
+        bit[i] = (hash + i * step) % NGX_HTTP_NPHASE_BLOOM_BITS;
+    }
+
+    return hash;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_neg_cache_get(ngx_http_request_t *r,
+    ngx_http_nphase_conf_t *npcf, ngx_http_nphase_ctx_t *ctx)
+{
+    u_char                       *p;
+    size_t                        len;
+    uint32_t                      hash;
+    ngx_int_t                     status;
+    ngx_uint_t                    i, bit[NGX_HTTP_NPHASE_BLOOM_HASHES];
+    ngx_str_t                    *key;
+    ngx_http_nphase_loc_node_t   *lcn;
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    /*
+     * the key of a missing file is the host and the evaluated metadata
+     * uri, args included; a host has no spaces and no colons, location
+     * keys start with "offset:"
+     */
+
+    if (npcf->loc_cache_zone == NULL || npcf->loc_cache_neg == 0) {
+        return NGX_DECLINED;
+    }
+
+    key = &ctx->neg_key;
+
+    if (key->data == NULL) {
+        len = r->headers_in.server.len + 1 + ctx->uri_var_value.len;
+
+        if (ctx->uri_var_value.len == 0 || len > 65535) {
+            return NGX_DECLINED;
+        }
+
+        p = ngx_pnalloc(r->pool, len);
+        if (p == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        key->data = p;
+        key->len = ngx_sprintf(p, "%V %V", &r->headers_in.server,
+                               &ctx->uri_var_value)
+                   - p;
+    }
+
+    cache = npcf->loc_cache_zone->data;
+    hash = ngx_http_nphase_bloom_bits(key, bit);
+
+    /*
+     * read without the mutex, requests for files that exist pass here;
+     * a bit set or cleared meanwhile costs one phase 1 at most
+     */
+
+    for (i = 0; i < NGX_HTTP_NPHASE_BLOOM_HASHES; i++) {
+        if ((cache->sh->bloom[bit[i] >> 3] & (1 << (bit[i] & 7))) == 0) {
+            return NGX_DECLINED;
+        }
+    }
+
+    status = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lcn = ngx_http_nphase_loc_cache_find(cache, key, hash);
+
+    if (lcn && lcn->status) {
+        if (lcn->expire > ngx_time()) {
+            status = lcn->status;
+
+        } else {
+            ngx_http_nphase_loc_cache_remove(cache, lcn);
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (status != NGX_DECLINED) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "nphase negative cache hit: \"%V\" %i",
+                       key, status);
+    }
+
+    return status;
+}
+
+
+static void
+ngx_http_nphase_neg_cache_insert(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_uint_t status)
+{
+    size_t                        size;
+    uint32_t                      hash;
+    ngx_str_t                    *key;
+    ngx_uint_t                    i, bit[NGX_HTTP_NPHASE_BLOOM_HASHES];
+    ngx_rbtree_node_t            *node;
+    ngx_http_nphase_conf_t       *npcf;
+    ngx_http_nphase_loc_node_t   *lcn;
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    /* the key is built by ngx_http_nphase_neg_cache_get() */
+
+    key = &ctx->neg_key;
+
+    if (npcf->loc_cache_zone == NULL
+        || npcf->loc_cache_neg == 0
+        || key->len == 0)
+    {
+        return;
+    }
+
+    cache = npcf->loc_cache_zone->data;
+    hash = ngx_http_nphase_bloom_bits(key, bit);
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_nphase_loc_node_t, data)
+           + key->len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lcn = ngx_http_nphase_loc_cache_find(cache, key, hash);
+    if (lcn) {
+        ngx_http_nphase_loc_cache_remove(cache, lcn);
+    }
+
+    node = ngx_http_nphase_loc_cache_alloc(cache, size);
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    node->key = hash;
+
+    lcn = (ngx_http_nphase_loc_node_t *) &node->color;
+
+    lcn->len = (u_short) key->len;
+    lcn->loc_len = 0;
+    lcn->status = (u_short) status;
+    lcn->expire = ngx_time() + npcf->loc_cache_neg;
+    lcn->wfsz = 0;
+
+    ngx_memcpy(lcn->data, key->data, key->len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &lcn->queue);
+
+    if (cache->sh->bloom_n++ >= NGX_HTTP_NPHASE_BLOOM_MAX) {
+        /*
+         * bits can not be taken out one by one; start over, the entries
+         * that are still valid are found again after their next phase 1
+         */
+        ngx_memzero(cache->sh->bloom, sizeof(cache->sh->bloom));
+        cache->sh->bloom_n = 1;
+    }
+
+    for (i = 0; i < NGX_HTTP_NPHASE_BLOOM_HASHES; i++) {
+        cache->sh->bloom[bit[i] >> 3] |= (u_char) (1 << (bit[i] & 7));
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase negative cache store: \"%V\" %ui",
+                   key, status);
+}
+
+
+static char *
+ngx_http_nphase_prefetch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+
+    ssize_t                      size;
+    ngx_int_t                    n;
+    ngx_str_t                   *value, s;
+    ngx_uint_t                   i;
+
+    if (npcf->prefetch != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        npcf->prefetch = 0;
+        return NGX_CONF_OK;
+    }
+
+#ifndef NGX_HTTP_SUBREQUEST_BACKGROUND
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires background subrequests, "
+                       "nginx 1.13.1 or newer", &cmd->name);
+    return NGX_CONF_ERROR;
+
+#else
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        i = 1;
+        goto invalid;
+    }
+
+    npcf->prefetch = (ngx_uint_t) n;
+    npcf->prefetch_data = 0;
+    npcf->prefetch_at = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "data") == 0) {
+            npcf->prefetch_data = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "at=", 3) == 0) {
+            s.len = value[i].len - 3;
+            s.data = value[i].data + 3;
+
+            if (s.len && s.data[s.len - 1] == '%') {
+                s.len--;
+            }
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            npcf->prefetch_at = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0) {
+                goto invalid;
+            }
+
+            npcf->prefetch_buffer = (size_t) size;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (npcf->prefetch_data && npcf->prefetch_at) {
+        return "\"at=\" can not be used with \"data\"";
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
+static char *
+ngx_http_nphase_stripe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+
+    ssize_t                      size;
+    ngx_int_t                    n;
+    ngx_str_t                   *value, s;
+    ngx_uint_t                   i;
+
+    if (npcf->stripe != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    if (npcf->prefetch != NGX_CONF_UNSET_UINT) {
+        return "conflicts with \"nphase_prefetch\"";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        npcf->stripe = 0;
+        npcf->prefetch = 0;
+        return NGX_CONF_OK;
+    }
+
+#ifndef NGX_HTTP_SUBREQUEST_BACKGROUND
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires background subrequests, "
+                       "nginx 1.13.1 or newer", &cmd->name);
+    return NGX_CONF_ERROR;
+
+#else
+
+    /* K stripes: the current segment plus K - 1 fetched ahead */
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n < 2) {
+        i = 1;
+        goto invalid;
+    }
+
+    npcf->stripe = 1;
+    npcf->prefetch = (ngx_uint_t) n - 1;
+    npcf->prefetch_data = 1;
+    npcf->prefetch_at = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0) {
+                goto invalid;
+            }
+
+            npcf->prefetch_buffer = (size_t) size;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+static ngx_int_t
+ngx_http_nphase_run_prefetch(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_seg_t *seg, ngx_uint_t phase)
+{
+#ifdef NGX_HTTP_SUBREQUEST_BACKGROUND
+    ngx_int_t                        rc;
+    ngx_http_request_t              *sr;
+    ngx_http_nphase_conf_t          *npcf;
+    ngx_http_nphase_peer_t           peer;
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if (phase == 2 && ngx_http_nphase_is_local(npcf, &seg->loc)) {
+        /* stays located, the main loop reads it when its turn comes */
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_nphase_peer_lookup(r, ctx,
+                          (phase == 1) ? &ctx->uri_var_value : &seg->loc,
+                          &peer);
+    if (rc != NGX_OK) {
+        /* a located segment is tried again when the name resolved */
+        return rc;
+    }
+
+    sr_ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_nphase_sub_ctx_t));
+    if (sr_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    sr_ctx->range.data = seg->range_buf;
+    sr_ctx->range.len = ngx_sprintf(seg->range_buf, "bytes=%O-%O", 
+                                    seg->start, seg->end)
+                        - seg->range_buf;
+    sr_ctx->uri = (phase == 1) ? ctx->uri_var_value : seg->loc;
+    sr_ctx->peer = peer;
+    sr_ctx->seg = seg;
+    sr_ctx->phase = phase;
+
+    ctx->ps.handler = ngx_http_nphase_subrequest_done;
+    ctx->ps.data = ctx;
+
+    rc = NGX_DECLINED;
+
+    if (phase == 2) {
+        rc = ngx_http_nphase_balance_reserve(ctx, &seg->loc, npcf->max_conns);
+
+        if (rc == NGX_BUSY) {
+            /* a located segment is tried again by the next loop */
+            return NGX_BUSY;
+        }
+    }
+
+    /* not in the postponed list: the main loop orders the output */
+    if (ngx_http_subrequest(r, &npcf->uri, NULL, &sr, &ctx->ps,
+                            NGX_HTTP_SUBREQUEST_BACKGROUND)
+        != NGX_OK)
+    {
+        if (rc == NGX_OK) {
+            ngx_http_nphase_balance_release(ctx, &seg->loc);
+        }
+
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(sr, sr_ctx, ngx_http_nphase_module);
+
+    if (phase == 2) {
+        seg->sr = sr;
+
+        if (rc == NGX_OK) {
+            ngx_http_nphase_balance_begin(ctx, sr_ctx);
+        }
+    }
+
+    seg->nsr++;
+    ctx->sr_count++;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase prefetch phase %ui: %V %V",
+                   phase, &sr_ctx->uri, &sr_ctx->range);
+
+    return NGX_OK;
+#else
+    return NGX_DECLINED;
+#endif
+}
+
+
+static void
+ngx_http_nphase_prefetch_next(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    off_t                            last;
+    ngx_queue_t                     *q;
+    ngx_http_request_t              *pr;
+    ngx_http_nphase_seg_t           *seg;
+    ngx_http_nphase_conf_t          *npcf;
+    ngx_http_nphase_range_t          cr, *rin;
+
+    pr = r->parent;
+    npcf = ngx_http_get_module_loc_conf(pr, ngx_http_nphase_module);
+
+    if (npcf->prefetch == 0 
+        || ctx->prefetch_n >= npcf->prefetch 
+        || ctx->multipart) 
+    {
+        return;
+    }
+
+    rin = ngx_http_nphase_range_cur(ctx);
+
+    if (rin->flag == 2 || r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT) {
+        return;
+    }
+
+    /* the chunk server cuts the range at its segment end */
+
+    if (ngx_http_nphase_content_range(r, &cr) != NGX_OK) {
+        return;
+    }
+
+    last = ngx_http_nphase_range_last(ctx);
+    if (cr.end >= last) {
+        return;
+    }
+
+    if (!ngx_queue_empty(&ctx->prefetch)) {
+        q = ngx_queue_last(&ctx->prefetch);
+        seg = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+        if (seg->start > cr.end) {
+            return;
+        }
+    }
+
+    seg = ngx_http_nphase_seg_alloc(pr, ctx);
+    if (seg == NULL) {
+        return;
+    }
+
+    seg->start = cr.end + 1;
+    seg->end = last;
+    seg->part = ctx->part;
+
+    ngx_http_nphase_prefetch_start(pr, ctx, seg);
+}
+
+
+static void
+ngx_http_nphase_prefetch_start(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg)
+{
+    off_t                            wfsz, end;
+    ngx_http_nphase_conf_t          *npcf;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    seg->state = NGX_HTTP_NPHASE_SEG_LOOKUP;
+
+    ngx_queue_insert_tail(&ctx->prefetch, &seg->queue);
+    ctx->prefetch_n++;
+
+    if (npcf->loc_cache_zone
+        && ngx_http_nphase_loc_cache_key(r, ctx, seg->start, &seg->key)
+           == NGX_OK
+        && ngx_http_nphase_loc_cache_get(r, &seg->key, &seg->loc, &wfsz,
+                                         &seg->loc_buf, NULL, NULL)
+           == NGX_OK)
+    {
+        seg->state = NGX_HTTP_NPHASE_SEG_LOCATED;
+        ngx_http_nphase_prefetch_fetch(r, ctx, seg);
+        return;
+    }
+
+    if (ngx_http_nphase_extent_find(ctx, seg->start, &seg->loc, &end) 
+        == NGX_OK)
+    {
+        if (end < seg->end) {
+            seg->end = end;
+        }
+
+        seg->state = NGX_HTTP_NPHASE_SEG_LOCATED;
+        ngx_http_nphase_prefetch_fetch(r, ctx, seg);
+        return;
+    }
+
+    ngx_http_nphase_prefetch_lookup(r, ctx, seg);
+}
+
+
+static void
+ngx_http_nphase_prefetch_lookup(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg)
+{
+    ngx_int_t                        rc;
+
+    rc = ngx_http_nphase_run_prefetch(r, ctx, seg, 1);
+
+    if (rc == NGX_AGAIN) {
+        /* the metadata server name is resolved, the schedule asks again */
+        seg->state = NGX_HTTP_NPHASE_SEG_RESOLVE;
+        return;
+    }
+
+    seg->state = (rc == NGX_OK) ? NGX_HTTP_NPHASE_SEG_LOOKUP
+                                : NGX_HTTP_NPHASE_SEG_ERROR;
+}
+
+
+static void
+ngx_http_nphase_prefetch_fetch(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg)
+{
+    ngx_http_nphase_conf_t          *npcf;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if ((!npcf->prefetch_data && !ctx->multipart)
+        || ctx->prefetch_held >= (off_t) npcf->prefetch_buffer
+        || ngx_http_nphase_over_budget(r, ctx))
+    {
+        /* stays located, scheduled again when the client took data */
+        return;
+    }
+
+    if ((npcf->stripe || ctx->multipart)
+        && ngx_http_nphase_prefetch_host_busy(ctx, seg))
+    {
+        /* stays located, scheduled again when a stripe finishes */
+        return;
+    }
+
+    if (ngx_http_nphase_run_prefetch(r, ctx, seg, 2) == NGX_OK) {
+        seg->state = NGX_HTTP_NPHASE_SEG_FETCH;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_nphase_prefetch_header(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx)
+{
+    off_t                            start, end;
+    ngx_http_nphase_seg_t           *seg;
+    ngx_http_nphase_range_t          cr;
+
+    seg = sr_ctx->seg;
+
+    if (seg->discard) {
+        return NGX_OK;
+    }
+
+    /* failures are swallowed, the main loop looks the segment up again */
+
+    if (sr_ctx->phase == 1) {
+        if (r->headers_out.status != NGX_HTTP_MOVED_TEMPORARILY
+            || ngx_http_nphase_parse_location(r, &seg->loc, &seg->loc_buf) 
+               != NGX_OK)
+        {
+            seg->state = NGX_HTTP_NPHASE_SEG_ERROR;
+            return NGX_OK;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "nphase prefetch loc: %O %V", seg->start, &seg->loc);
+
+        ngx_http_nphase_loc_cache_insert(r->parent, &seg->key, &seg->loc,
+                                         ctx->wfsz, NULL, -1);
+
+        ngx_http_nphase_parse_segment_map(r, ctx);
+
+        if (ngx_http_nphase_segment_range(r, &start, &end) == NGX_OK) {
+            if (end < seg->end) {
+                seg->end = end;
+            }
+
+            if (ctx->multipart) {
+                (void) ngx_http_nphase_extent_push(r, ctx, start, end,
+                                                   &seg->loc, 1);
+            }
+        }
+
+        seg->state = NGX_HTTP_NPHASE_SEG_LOCATED;
+        ngx_http_nphase_prefetch_fetch(r->parent, ctx, seg);
+        return NGX_OK;
+    }
+
+    if (r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT
+        || ngx_http_nphase_content_range(r, &cr) != NGX_OK
+        || cr.start != seg->start
+        || cr.end > seg->end)
+    {
+        seg->state = NGX_HTTP_NPHASE_SEG_ERROR;
+        return NGX_OK;
+    }
+
+    seg->status = r->headers_out.status;
+
+    if (seg->hedge && ctx->hedge == seg && !ctx->body_ready) {
+        /* answered before the current subrequest, go on with this one */
+        ctx->hedge_won = 1;
+        ngx_http_nphase_abort(ctx->sr_fg);
+    }
+
+    if (ctx->multipart) {
+        ngx_http_nphase_extent_add(r, ctx, &seg->loc);
+    }
+
+    ngx_http_nphase_prefetch_next(r, ctx);
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_prefetch_done(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx)
+{
+    ngx_http_nphase_seg_t           *seg;
+
+    seg = sr_ctx->seg;
+
+    if (sr_ctx->phase == 1) {
+        if (seg->state == NGX_HTTP_NPHASE_SEG_LOOKUP) {
+            seg->state = NGX_HTTP_NPHASE_SEG_ERROR;
+        }
+
+    } else {
+        if (seg->state == NGX_HTTP_NPHASE_SEG_FETCH) {
+            seg->state = seg->held ? NGX_HTTP_NPHASE_SEG_DONE
+                                   : NGX_HTTP_NPHASE_SEG_ERROR;
+        }
+
+        if (seg->sr == r) {
+            seg->sr = NULL;
+        }
+
+        if (seg->state == NGX_HTTP_NPHASE_SEG_ERROR && seg->held == 0
+            && !seg->discard)
+        {
+            /* the main loop takes a replica of the segment, if any */
+            ngx_http_nphase_extent_drop(ctx, seg->start, &seg->loc);
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase prefetch done phase %d: %O state:%d",
+                   (int) sr_ctx->phase, seg->start, (int) seg->state);
+
+    seg->nsr--;
+
+    if (!seg->discard) {
+        ngx_http_post_request(r->parent, NULL);
+
+    } else if (seg->nsr == 0) {
+        ngx_queue_insert_head(&ctx->seg_free, &seg->queue);
+    }
+
+    /* a failed prefetch must not finalize the main request */
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_prefetch_take(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_conf_t *npcf, off_t offset)
+{
+    u_char                          *p;
+    ngx_int_t                        rc;
+    ngx_queue_t                     *q;
+    ngx_http_nphase_seg_t           *seg;
+
+    if (ngx_queue_empty(&ctx->prefetch)) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_head(&ctx->prefetch);
+    seg = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+    if (seg->part != ctx->part || seg->start > offset) {
+        /* a stripe stopped short, fill the gap in front of the next one */
+        return NGX_DECLINED;
+    }
+
+    if (seg->start < offset) {
+        /* the segment ended elsewhere, nothing prefetched is usable */
+        ngx_http_nphase_prefetch_cancel(r, ctx);
+        return NGX_DECLINED;
+    }
+
+    switch (seg->state) {
+
+    case NGX_HTTP_NPHASE_SEG_LOOKUP:
+    case NGX_HTTP_NPHASE_SEG_RESOLVE:
+        return NGX_AGAIN;
+
+    case NGX_HTTP_NPHASE_SEG_ERROR:
+        ngx_http_nphase_prefetch_discard(r, ctx, seg);
+        return NGX_DECLINED;
+
+    case NGX_HTTP_NPHASE_SEG_LOCATED:
+        ngx_queue_remove(&seg->queue);
+        ctx->prefetch_n--;
+
+        /* the segment buffers are recycled, copy what the loop keeps */
+
+        p = ngx_http_nphase_reserve(r->pool, &ctx->loc_buf, seg->loc.len);
+        if (p == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->loc_body_c.len = ngx_cpymem(p, seg->loc.data, seg->loc.len) - p;
+        ctx->loc_body_c.data = p;
+        ctx->loc_end = seg->end;
+
+        ctx->loc_key.len = 0;
+
+        if (seg->key.len
+            && ngx_http_nphase_loc_cache_key(r, ctx, seg->start,
+                                             &ctx->loc_key)
+               == NGX_ERROR)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_nphase_seg_release(ctx, seg);
+
+        ctx->loc_cached = 0;
+        ctx->loc_stale = 0;
+        ctx->replicas.len = 0;
+        ctx->loc_ready = 0;
+        ctx->body_ready = 0;
+
+        return ngx_http_nphase_run_location(r, ctx, npcf);
+    }
+
+    /* NGX_HTTP_NPHASE_SEG_FETCH, NGX_HTTP_NPHASE_SEG_DONE */
+
+    ngx_queue_remove(&seg->queue);
+    ctx->prefetch_n--;
+    ctx->prefetch_held -= seg->held;
+
+    seg->promoted = 1;
+    ctx->sr_done = 0;
+    ctx->seg_cur = seg;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase prefetch promote: %O held:%O",
+                   seg->start, seg->held);
+
+    if (!ctx->header_sent && seg->status) {
+        /* a hedge may answer the first segment */
+        ctx->pr_status = seg->status;
+
+        if (ngx_http_send_header(r) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (seg->out) {
+        rc = ngx_http_output_filter(r, seg->out);
+
+        ngx_http_nphase_free_links(r->pool, seg->out);
+        seg->out = NULL;
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (seg->state == NGX_HTTP_NPHASE_SEG_DONE) {
+        /* finished while held, account it and run the loop again */
+        ngx_http_nphase_stripe_sent(ctx, seg);
+        ngx_http_nphase_seg_release(ctx, seg);
+        ctx->seg_cur = NULL;
+        ctx->sr_done = 1;
+
+        ngx_http_post_request(r, NULL);
+        return NGX_AGAIN;
+    }
+
+    ngx_http_nphase_prefetch_resume(seg);
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_nphase_prefetch_schedule(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_queue_t                     *q;
+    ngx_http_nphase_seg_t           *seg;
+
+    /* start stripes deferred because their host was busy or a name */
+
+    for (q = ngx_queue_head(&ctx->prefetch);
+         q != ngx_queue_sentinel(&ctx->prefetch);
+         q = ngx_queue_next(q))
+    {
+        seg = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+        if (seg->state == NGX_HTTP_NPHASE_SEG_LOCATED) {
+            ngx_http_nphase_prefetch_fetch(r, ctx, seg);
+
+        } else if (seg->state == NGX_HTTP_NPHASE_SEG_RESOLVE) {
+            ngx_http_nphase_prefetch_lookup(r, ctx, seg);
+        }
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_nphase_prefetch_host_busy(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_seg_t *seg)
+{
+    ngx_str_t                        host, busy;
+    ngx_queue_t                     *q;
+    ngx_http_nphase_seg_t           *s;
+
+    ngx_http_nphase_loc_host(&seg->loc, &host);
+
+    if (ctx->seg_cur) {
+        ngx_http_nphase_loc_host(&ctx->seg_cur->loc, &busy);
+
+    } else if (ctx->body_ready && !ctx->sr_done) {
+        ngx_http_nphase_loc_host(&ctx->loc_body_c, &busy);
+
+    } else {
+        busy.len = 0;
+    }
+
+    if (busy.len == host.len
+        && ngx_strncasecmp(busy.data, host.data, host.len) == 0)
+    {
+        return 1;
+    }
+
+    for (q = ngx_queue_head(&ctx->prefetch);
+         q != ngx_queue_sentinel(&ctx->prefetch);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+        if (s == seg || s->state != NGX_HTTP_NPHASE_SEG_FETCH) {
+            continue;
+        }
+
+        ngx_http_nphase_loc_host(&s->loc, &busy);
+
+        if (busy.len == host.len
+            && ngx_strncasecmp(busy.data, host.data, host.len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+ngx_http_nphase_prefetch_discard(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_seg_t *seg)
+{
+    ngx_queue_remove(&seg->queue);
+    ctx->prefetch_n--;
+    ctx->prefetch_held -= seg->held;
+
+    ngx_http_nphase_discard_bufs(r->pool, seg->out);
+    ngx_http_nphase_free_links(r->pool, seg->out);
+    seg->out = NULL;
+    seg->held = 0;
+
+    ngx_http_nphase_prefetch_resume(seg);
+    ngx_http_nphase_seg_release(ctx, seg);
+}
+
+
+static ngx_http_nphase_seg_t *
+ngx_http_nphase_seg_alloc(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    u_char                          *key;
+    ngx_queue_t                     *q;
+    ngx_http_nphase_seg_t           *seg;
+    ngx_http_nphase_strbuf_t         loc_buf;
+
+    if (ngx_queue_empty(&ctx->seg_free)) {
+        return ngx_pcalloc(r->pool, sizeof(ngx_http_nphase_seg_t));
+    }
+
+    q = ngx_queue_head(&ctx->seg_free);
+    ngx_queue_remove(q);
+
+    seg = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+    key = seg->key.data;
+    loc_buf = seg->loc_buf;
+
+    ngx_memzero(seg, sizeof(ngx_http_nphase_seg_t));
+
+    seg->key.data = key;
+    seg->loc_buf = loc_buf;
+
+    return seg;
+}
+
+
+static void
+ngx_http_nphase_seg_release(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_seg_t *seg)
+{
+    /* out of the queue; recycled once its last subrequest is done */
+
+    seg->discard = 1;
+
+    if (seg->nsr == 0) {
+        ngx_queue_insert_head(&ctx->seg_free, &seg->queue);
+    }
+}
+
+
+static void
+ngx_http_nphase_prefetch_cancel(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_queue_t                     *q;
+    ngx_http_nphase_seg_t           *seg;
+
+    while (!ngx_queue_empty(&ctx->prefetch)) {
+        q = ngx_queue_head(&ctx->prefetch);
+        seg = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+        ngx_http_nphase_prefetch_discard(r, ctx, seg);
+    }
+}
+
+
+static void
+ngx_http_nphase_prefetch_resume(ngx_http_nphase_seg_t *seg)
+{
+    /*
+     * held buffers were consumed, the subrequest runs its own write
+     * handler, which lets the pipe read from the chunk server again
+     */
+
+    if (seg->sr == NULL || seg->sr->upstream == NULL || seg->sr->done) {
+        return;
+    }
+
+    (void) ngx_http_post_request(seg->sr, NULL);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_peer_lookup(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_str_t *uri, ngx_http_nphase_peer_t *peer)
+{
+    u_char                          *p, *last, *port;
+    ngx_int_t                        n, rc;
+    ngx_str_t                        name;
+    ngx_http_nphase_conf_t          *npcf;
+
+    ngx_memzero(peer, sizeof(ngx_http_nphase_peer_t));
+
+    if (uri->len == 0
+        || ngx_strlcasestrn(uri->data, uri->data + uri->len,
+                            (u_char *) "://", 3 - 1)
+           == NULL)
+    {
+        return NGX_OK;
+    }
+
+    ngx_http_nphase_loc_host(uri, &peer->host);
+
+    last = uri->data + uri->len;
+    p = peer->host.data + peer->host.len;
+
+    peer->path.data = p;
+    peer->path.len = last - p;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if (!npcf->resolve) {
+        return NGX_OK;
+    }
+
+    /* "host", "host:port", "[addr]:port" */
+
+    name = peer->host;
+    last = name.data + name.len;
+    port = NULL;
+
+    if (name.len && name.data[0] == '[') {
+        p = ngx_strlchr(name.data, last, ']');
+        if (p == NULL) {
+            goto invalid;
+        }
+
+        name.data++;
+        name.len = p - name.data;
+
+        if (p + 1 < last) {
+            if (p[1] != ':') {
+                goto invalid;
+            }
+
+            port = p + 2;
+        }
+
+    } else {
+        p = ngx_strlchr(name.data, last, ':');
+
+        if (p) {
+            name.len = p - name.data;
+            port = p + 1;
+        }
+    }
+
+    n = 80;
+
+    if (port) {
+        n = ngx_atoi(port, last - port);
+        if (n < 1 || n > 65535) {
+            goto invalid;
+        }
+    }
+
+    if (name.len == 0) {
+        goto invalid;
+    }
+
+    rc = ngx_http_nphase_peer_resolve(r, ctx, &name, peer);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_inet_set_port((struct sockaddr *) &peer->sockaddr, (in_port_t) n);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "nphase invalid host \"%V\" in \"%V\"", &peer->host, uri);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_peer_resolve(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_str_t *name, ngx_http_nphase_peer_t *peer)
+{
+    u_char                          *p;
+    ngx_queue_t                     *q;
+    ngx_resolver_ctx_t              *rctx, temp;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_nphase_resolve_t       *res;
+
+    for (q = ngx_queue_head(&ctx->resolving);
+         q != ngx_queue_sentinel(&ctx->resolving);
+         q = ngx_queue_next(q))
+    {
+        res = ngx_queue_data(q, ngx_http_nphase_resolve_t, queue);
+
+        if (res->name.len != name->len
+            || ngx_strncasecmp(res->name.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (res->rctx) {
+            /* asked already, the answer wakes the main loop */
+            return NGX_AGAIN;
+        }
+
+        /* failed, reported once, the next segment asks again */
+
+        ngx_queue_remove(&res->queue);
+        ngx_queue_insert_head(&ctx->resolve_free, &res->queue);
+
+        return NGX_ERROR;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /* names are answered from the resolver cache of the worker */
+
+    ngx_memzero(&temp, sizeof(ngx_resolver_ctx_t));
+    temp.name = *name;
+
+    rctx = ngx_resolve_start(clcf->resolver, &temp);
+    if (rctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (rctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase no resolver defined to resolve %V", name);
+        return NGX_ERROR;
+    }
+
+    if (rctx->quick) {
+        /* an address literal */
+        ngx_memcpy(&peer->sockaddr, rctx->addrs[0].sockaddr,
+                   rctx->addrs[0].socklen);
+        peer->socklen = rctx->addrs[0].socklen;
+        return NGX_OK;
+    }
+
+    if (ngx_http_nphase_add_cleanup(r, ctx) != NGX_OK) {
+        ngx_resolve_name_done(rctx);
+        return NGX_ERROR;
+    }
+
+    if (!ngx_queue_empty(&ctx->resolve_free)) {
+        q = ngx_queue_head(&ctx->resolve_free);
+        ngx_queue_remove(q);
+        res = ngx_queue_data(q, ngx_http_nphase_resolve_t, queue);
+
+    } else {
+        res = ngx_pcalloc(r->pool, sizeof(ngx_http_nphase_resolve_t));
+        if (res == NULL) {
+            ngx_resolve_name_done(rctx);
+            return NGX_ERROR;
+        }
+    }
+
+    /* the uri buffer may be reused before an answer comes */
+    p = ngx_http_nphase_reserve(r->pool, &res->name_buf, name->len);
+    if (p == NULL) {
+        ngx_queue_insert_head(&ctx->resolve_free, &res->queue);
+        ngx_resolve_name_done(rctx);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, name->data, name->len);
+
+    res->name.data = p;
+    res->name.len = name->len;
+    res->rctx = rctx;
+    res->request = r;
+    res->peer = peer;
+    res->failed = 0;
+
+    ngx_queue_insert_tail(&ctx->resolving, &res->queue);
+
+    rctx->name = res->name;
+    rctx->handler = ngx_http_nphase_peer_resolved;
+    rctx->data = res;
+    rctx->timeout = clcf->resolver_timeout;
+
+    if (ngx_resolve_name(rctx) != NGX_OK) {
+        ngx_queue_remove(&res->queue);
+        ngx_queue_insert_head(&ctx->resolve_free, &res->queue);
+        return NGX_ERROR;
+    }
+
+    res->peer = NULL;
+
+    if (res->rctx) {
+        return NGX_AGAIN;
+    }
+
+    /* answered at once */
+
+    ngx_queue_remove(&res->queue);
+    ngx_queue_insert_head(&ctx->resolve_free, &res->queue);
+
+    return res->failed ? NGX_ERROR : NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_peer_resolved(ngx_resolver_ctx_t *rctx)
+{
+    ngx_uint_t                       i;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_nphase_ctx_t           *ctx;
+    ngx_http_nphase_peer_t          *peer;
+    ngx_http_nphase_resolve_t       *res;
+
+    res = rctx->data;
+    r = res->request;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+    peer = res->peer;
+
+    if (rctx->state) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "nphase %V could not be resolved (%i: %s)",
+                      &rctx->name, rctx->state,
+                      ngx_resolver_strerror(rctx->state));
+        res->failed = 1;
+
+    } else if (peer) {
+        i = ngx_random() % rctx->naddrs;
+
+        ngx_memcpy(&peer->sockaddr, rctx->addrs[i].sockaddr,
+                   rctx->addrs[i].socklen);
+        peer->socklen = rctx->addrs[i].socklen;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "nphase resolved %V state:%i", &rctx->name, rctx->state);
+
+    ngx_resolve_name_done(rctx);
+
+    res->rctx = NULL;
+
+    if (peer) {
+        /* called from ngx_resolve_name(), the caller goes on */
+        return;
+    }
+
+    if (ctx == NULL) {
+        /* an internal redirect took the request elsewhere meanwhile */
+        return;
+    }
+
+    if (!res->failed) {
+        /* a failure stays to be reported to the next lookup of the name */
+        ngx_queue_remove(&res->queue);
+        ngx_queue_insert_head(&ctx->resolve_free, &res->queue);
+    }
+
+    /* the answer is in the resolver cache now, start what waited for it */
+
+    ngx_http_post_request(r, NULL);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_add_cleanup(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_pool_cleanup_t              *cln;
+
+    if (ctx->cln) {
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_nphase_cleanup;
+    cln->data = ctx;
+    ctx->cln = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_cleanup(void *data)
+{
+    ngx_http_nphase_ctx_t  *ctx = data;
+
+    ngx_queue_t                     *q;
+    ngx_http_nphase_seg_t           *seg;
+    ngx_http_nphase_resolve_t       *res;
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+
+    /*
+     * the request goes away while waiting; r->ctx may be gone already
+     * after an internal redirect, the ctx is kept in the pool till here
+     */
+
+    ngx_http_nphase_loc_cache_unlock(ngx_cycle->log, ctx);
+
+    if (ctx->loc_ev.timer_set) {
+        ngx_del_timer(&ctx->loc_ev);
+    }
+
+    for (q = ngx_queue_head(&ctx->resolving);
+         q != ngx_queue_sentinel(&ctx->resolving);
+         q = ngx_queue_next(q))
+    {
+        res = ngx_queue_data(q, ngx_http_nphase_resolve_t, queue);
+
+        if (res->rctx) {
+            ngx_resolve_name_done(res->rctx);
+            res->rctx = NULL;
+        }
+    }
+
+    if (ctx->retry_ev.timer_set) {
+        ngx_del_timer(&ctx->retry_ev);
+    }
+
+    if (ctx->hedge_ev.timer_set) {
+        ngx_del_timer(&ctx->hedge_ev);
+    }
+
+    if (ctx->queue_ev.timer_set) {
+        ngx_del_timer(&ctx->queue_ev);
+    }
+
+    if (ctx->local_pool) {
+        ngx_destroy_pool(ctx->local_pool);
+        ctx->local_pool = NULL;
+    }
+
+    if (ctx->balance == NULL) {
+        return;
+    }
+
+    if (ngx_http_nphase_balance_unwait(ctx) == NGX_OK) {
+        ctx->reserved = 1;
+    }
+
+    if (ctx->reserved) {
+        ngx_http_nphase_balance_release(ctx, &ctx->loc_body_c);
+    }
+
+    if (ctx->sr_fg) {
+        sr_ctx = ngx_http_get_module_ctx(ctx->sr_fg, ngx_http_nphase_module);
+        ngx_http_nphase_balance_end(ngx_cycle->log, ctx, sr_ctx, 0);
+    }
+
+    if (ctx->seg_cur && ctx->seg_cur->sr) {
+        sr_ctx = ngx_http_get_module_ctx(ctx->seg_cur->sr,
+                                         ngx_http_nphase_module);
+        ngx_http_nphase_balance_end(ngx_cycle->log, ctx, sr_ctx, 0);
+    }
+
+    for (q = ngx_queue_head(&ctx->prefetch);
+         q != ngx_queue_sentinel(&ctx->prefetch);
+         q = ngx_queue_next(q))
+    {
+        seg = ngx_queue_data(q, ngx_http_nphase_seg_t, queue);
+
+        if (seg->sr) {
+            sr_ctx = ngx_http_get_module_ctx(seg->sr, ngx_http_nphase_module);
+            ngx_http_nphase_balance_end(ngx_cycle->log, ctx, sr_ctx, 0);
+        }
+    }
+}
+
+
+static char *
+ngx_http_nphase_dynamic(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_nphase_upstream_init;
+
+    /* the parameters are accepted as by other balancers, nothing uses them */
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_upstream_init(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    /* the servers of the block are not used, each subrequest brings one */
+
+    us->peer.init = ngx_http_nphase_upstream_init_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_upstream_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+
+    sr_ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+    if (r == r->main || sr_ctx == NULL || sr_ctx->peer.socklen == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase_dynamic upstream used without a resolved "
+                      "nphase subrequest, is nphase_resolve on?");
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_nphase_upstream_get_peer;
+    r->upstream->peer.free = ngx_http_nphase_upstream_free_peer;
+    r->upstream->peer.data = &sr_ctx->peer;
+    r->upstream->peer.tries = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_upstream_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_nphase_peer_t  *peer = data;
+
+    /* keepalive, when configured, pools connections by this address */
+
+    pc->sockaddr = (struct sockaddr *) &peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->host;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_upstream_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    pc->tries = 0;
+}
+
+
+static char *
+ngx_http_nphase_retry(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+
+    ngx_int_t                    n;
+    ngx_str_t                   *value, s;
+    ngx_msec_t                   backoff;
+
+    if (npcf->retry != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of attempts \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    npcf->retry = (ngx_uint_t) n;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "backoff=", 8) != 0) {
+            goto invalid;
+        }
+
+        s.len = value[2].len - 8;
+        s.data = value[2].data + 8;
+
+        backoff = ngx_parse_time(&s, 0);
+        if (backoff == (ngx_msec_t) NGX_ERROR) {
+            goto invalid;
+        }
+
+        npcf->retry_backoff = backoff;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
+}
+
+
+static void
+ngx_http_nphase_retry_next(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_str_t *loc, ngx_uint_t status)
+{
+    off_t                            offset;
+    ngx_uint_t                       ft;
+    ngx_msec_t                       delay;
+    ngx_http_nphase_conf_t          *npcf;
+
+    /*
+     * r is the failed subrequest, or the main request when a local read
+     * failed; the conf is the one of the main request
+     */
+
+    npcf = ngx_http_get_module_loc_conf(r->main, ngx_http_nphase_module);
+
+    ctx->sr_error = 1;
+    ctx->sr_count_e++;
+
+    /* the client gets 404 or 410 of phase 1 if this is the last try */
+    ctx->missing = (loc == NULL && !ctx->header_sent
+                    && (status == NGX_HTTP_NOT_FOUND
+                        || status == NGX_HTTP_GONE))
+                   ? status : 0;
+
+    switch (status) {
+
+    case NGX_HTTP_INTERNAL_SERVER_ERROR:
+        ft = NGX_HTTP_NPHASE_FT_HTTP_500;
+        break;
+
+    case NGX_HTTP_SERVICE_UNAVAILABLE:
+        ft = NGX_HTTP_NPHASE_FT_HTTP_503;
+        break;
+
+    case NGX_HTTP_GATEWAY_TIME_OUT:
+        ft = NGX_HTTP_NPHASE_FT_TIMEOUT;
+        break;
+
+    case NGX_HTTP_FORBIDDEN:
+        ft = NGX_HTTP_NPHASE_FT_HTTP_403;
+        break;
+
+    case NGX_HTTP_NOT_FOUND:
+        ft = NGX_HTTP_NPHASE_FT_HTTP_404;
+        break;
+
+    case NGX_HTTP_TOO_MANY_REQUESTS:
+        ft = NGX_HTTP_NPHASE_FT_HTTP_429;
+        break;
+
+    case NGX_HTTP_OK:
+    case NGX_HTTP_PARTIAL_CONTENT:
+    case NGX_HTTP_BAD_GATEWAY:
+        /* no body, or the server could not be reached */
+        ft = NGX_HTTP_NPHASE_FT_ERROR;
+        break;
+
+    default:
+        ft = 0;
+    }
+
+    if ((npcf->retry_on & ft) == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase phase %d status %ui is not retried",
+                      loc ? 2 : 1, status);
+
+        /* the main loop gives up at its next run */
+        ctx->sr_count_e = npcf->retry;
+        return;
+    }
+
+    if (loc) {
+        offset = ngx_http_nphase_range_cur(ctx)->start + ctx->range_sent.end;
+
+        if (ctx->loc_cached) {
+            /* phase 2 failed on a cached location, drop it */
+            ngx_http_nphase_loc_cache_delete(r->main, &ctx->loc_key);
+            ctx->loc_cached = 0;
+        }
+
+        ngx_http_nphase_extent_drop(ctx, offset, loc);
+
+        /* go to a replica directly, phase 1 only when none is left */
+
+        if (ngx_http_nphase_extent_find(ctx, offset, &ctx->loc_body_c,
+                                        &ctx->loc_end)
+            == NGX_OK)
+        {
+            ctx->loc_cached = 1;
+            ctx->loc_ready = 1;
+
+        } else if (ngx_http_nphase_replica_next(ctx, &ctx->loc_body_c)
+                   == NGX_OK)
+        {
+            ctx->loc_ready = 1;
+
+        } else {
+            ctx->loc_stale = 1;
+        }
+
+    } else {
+        ctx->loc_stale = 1;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase retry %ui after status %ui: %s", ctx->sr_count_e,
+                   status, ctx->loc_ready ? "replica" : "phase 1");
+
+    if (npcf->retry_backoff == 0 || ctx->sr_count_e >= npcf->retry) {
+        return;
+    }
+
+    if (ngx_http_nphase_add_cleanup(r->main, ctx) != NGX_OK) {
+        return;
+    }
+
+    delay = npcf->retry_backoff
+            << ngx_min(ctx->sr_count_e - 1, NGX_HTTP_NPHASE_MAX_BACKOFF_SHIFT);
+
+    ctx->retry_ev.handler = ngx_http_nphase_retry_handler;
+    ctx->retry_ev.data = r->main;
+    ctx->retry_ev.log = r->main->connection->log;
+
+    ngx_add_timer(&ctx->retry_ev, delay);
+}
+
+
+static void
+ngx_http_nphase_retry_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t              *r;
+
+    r = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "nphase retry backoff done");
+
+    ngx_http_post_request(r, NULL);
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static void
+ngx_http_nphase_parse_replicas(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx)
+{
+    u_char                          *p, *last, *s, *d;
+    size_t                           len, prefix;
+    ngx_str_t                        val;
+    ngx_str_t                        key = ngx_string("X-NP-Replicas");
+
+    /*
+     * "X-NP-Replicas: http://cs2/f, /cs3/f", more locations of the
+     * segment of Location, a relative one is on the metadata server
+     */
+
+    ctx->replicas.len = 0;
+
+    if (ngx_http_nphase_copy_header_value(&r->headers_out.headers, &key, &val)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    prefix = 0;
+
+    if (r->upstream && r->upstream->resolved) {
+        prefix = r->upstream->schema.len + r->upstream->resolved->host.len;
+    }
+
+    last = val.data + val.len;
+    len = val.len;
+
+    for (p = val.data; p < last; p++) {
+        if (*p == '/' && (p == val.data || p[-1] == ' ' || p[-1] == ',')) {
+            len += prefix;
+        }
+    }
+
+    if (ctx->balance) {
+        /* Location competes with its replicas */
+        len += ctx->loc_body_c.len + 1;
+    }
+
+    d = ngx_http_nphase_reserve(r->pool, &ctx->replica_buf, len);
+    if (d == NULL) {
+        return;
+    }
+
+    ctx->replicas.data = d;
+
+    if (ctx->balance) {
+        d = ngx_copy(d, ctx->loc_body_c.data, ctx->loc_body_c.len);
+        *d++ = ' ';
+    }
+
+    for (p = val.data; p < last; /* void */) {
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        s = p;
+
+        while (p < last && *p != ' ' && *p != ',') { p++; }
+
+        if (p == s) {
+            break;
+        }
+
+        if (*s == '/') {
+            if (prefix == 0) {
+                continue;
+            }
+
+            d = ngx_copy(d, r->upstream->schema.data,
+                         r->upstream->schema.len);
+            d = ngx_copy(d, r->upstream->resolved->host.data,
+                         r->upstream->resolved->host.len);
+        }
+
+        d = ngx_copy(d, s, p - s);
+        *d++ = ' ';
+    }
+
+    ctx->replicas.len = d - ctx->replicas.data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase replicas: \"%V\"", &ctx->replicas);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_replica_next(ngx_http_nphase_ctx_t *ctx, ngx_str_t *loc)
+{
+    u_char                          *p, *last, *s;
+    ngx_str_t                        cand[NGX_HTTP_NPHASE_BALANCE_CHOICES];
+    ngx_uint_t                       n;
+
+    /* take the first of the space separated replicas */
+
+    if (ctx->replicas.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    p = ctx->replicas.data;
+    last = p + ctx->replicas.len;
+
+    n = 0;
+
+    for (s = p; ctx->balance && s < last
+                && n < NGX_HTTP_NPHASE_BALANCE_CHOICES; s++)
+    {
+        cand[n].data = s;
+
+        s = ngx_strlchr(s, last, ' ');
+        if (s == NULL) {
+            s = last;
+        }
+
+        cand[n].len = s - cand[n].data;
+        n++;
+    }
+
+    if (n > 1) {
+        /* with nphase_balance the chosen one is moved to the front */
+
+        n = ngx_http_nphase_balance_choose(ctx, cand, n);
+
+        if (n) {
+            s = ngx_min(cand[n].data + cand[n].len + 1, last);
+
+            ngx_http_nphase_reverse(p, cand[n].data);
+            ngx_http_nphase_reverse(cand[n].data, s);
+            ngx_http_nphase_reverse(p, s);
+        }
+    }
+
+    loc->data = p;
+
+    p = ngx_strlchr(p, last, ' ');
+    if (p == NULL) {
+        p = last;
+    }
+
+    loc->len = p - loc->data;
+
+    if (p < last) {
+        p++;
+    }
+
+    ctx->replicas.len = last - p;
+    ctx->replicas.data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_extent_other(ngx_http_nphase_ctx_t *ctx, off_t offset,
+    ngx_str_t *loc)
+{
+    ngx_int_t                        i;
+    ngx_http_nphase_extent_t        *ext;
+
+    /* a live replica of the extent at offset, not loc itself */
+
+    i = ngx_http_nphase_extent_pick(ctx, offset, loc);
+    if (i == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
+
+    ext = ctx->extents->elts;
+    *loc = ext[i].loc;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_extent_pick(ngx_http_nphase_ctx_t *ctx, off_t offset,
+    ngx_str_t *skip)
+{
+    ngx_str_t                        cand[NGX_HTTP_NPHASE_BALANCE_CHOICES];
+    ngx_uint_t                       i, n, idx[NGX_HTTP_NPHASE_BALANCE_CHOICES];
+    ngx_http_nphase_extent_t        *ext;
+
+    /* the first extent holding offset, or the one nphase_balance chooses */
+
+    if (ctx->extents == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ext = ctx->extents->elts;
+    n = 0;
+
+    for (i = 0; i < ctx->extents->nelts
+                && n < NGX_HTTP_NPHASE_BALANCE_CHOICES; i++)
+    {
+        if (offset >= ext[i].start && offset <= ext[i].end
+            && (skip == NULL
+                || ext[i].loc.len != skip->len
+                || ngx_strncmp(ext[i].loc.data, skip->data, skip->len) != 0))
+        {
+            cand[n] = ext[i].loc;
+            idx[n++] = i;
+        }
+    }
+
+    if (n == 0) {
+        return NGX_DECLINED;
+    }
+
+    return idx[ngx_http_nphase_balance_choose(ctx, cand, n)];
+}
+
+
+static ngx_uint_t
+ngx_http_nphase_balance_choose(ngx_http_nphase_ctx_t *ctx, ngx_str_t *cand,
+    ngx_uint_t n)
+{
+    ngx_uint_t                       i, m, a, b;
+    ngx_uint_t                       cost[NGX_HTTP_NPHASE_BALANCE_CHOICES];
+    ngx_uint_t                       up[NGX_HTTP_NPHASE_BALANCE_CHOICES];
+
+    /*
+     * the cheaper of two random candidates (power of two choices),
+     * chunk servers with an open breaker only when all are
+     */
+
+    if (ctx->balance == NULL || n == 1) {
+        return 0;
+    }
+
+    m = 0;
+
+    for (i = 0; i < n; i++) {
+        cost[i] = ngx_http_nphase_balance_cost(ctx, &cand[i]);
+
+        if (cost[i] != NGX_HTTP_NPHASE_BALANCE_DOWN) {
+            up[m++] = i;
+        }
+    }
+
+    if (m == 0) {
+        for (i = 0; i < n; i++) {
+            up[m++] = i;
+        }
+    }
+
+    if (m == 1) {
+        return up[0];
+    }
+
+    a = ngx_random() % m;
+    b = ngx_random() % (m - 1);
+
+    if (b >= a) {
+        b++;
+    }
+
+    return (cost[up[b]] < cost[up[a]]) ? up[b] : up[a];
+}
+
+
+static void
+ngx_http_nphase_hedge_handler(ngx_event_t *ev)
+{
+    u_char                          *p;
+    ngx_str_t                        loc;
+    ngx_http_request_t              *r;
+    ngx_http_nphase_ctx_t           *ctx;
+    ngx_http_nphase_seg_t           *seg;
+
+    r = ev->data;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_nphase_module);
+
+    if (ctx == NULL
+        || ctx->body_ready || ctx->sr_done || !ctx->fetching || ctx->hedge)
+    {
+        return;
+    }
+
+    /* no answer yet, ask a replica for the same bytes */
+
+    loc = ctx->loc_body_c;
+
+    if (ngx_http_nphase_extent_other(ctx, ctx->fetch_start + ctx->fetch_skip,
+                                     &loc)
+        != NGX_OK
+        && ngx_http_nphase_replica_next(ctx, &loc) != NGX_OK)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "nphase hedge: no replica");
+        return;
+    }
+
+    seg = ngx_http_nphase_seg_alloc(r, ctx);
+    if (seg == NULL) {
+        return;
+    }
+
+    p = ngx_http_nphase_reserve(r->pool, &seg->loc_buf, loc.len);
+    if (p == NULL) {
+        ngx_queue_insert_head(&ctx->seg_free, &seg->queue);
+        return;
+    }
+
+    seg->loc.len = ngx_cpymem(p, loc.data, loc.len) - p;
+    seg->loc.data = p;
+    seg->start = ctx->fetch_start + ctx->fetch_skip;
+    seg->end = ctx->fetch_end;
+    seg->part = ctx->part;
+    seg->hedge = 1;
+
+    /* in front of the prefetched segments, it is the current one */
+    ngx_queue_insert_head(&ctx->prefetch, &seg->queue);
+    ctx->prefetch_n++;
+
+    if (ngx_http_nphase_run_prefetch(r, ctx, seg, 2) != NGX_OK) {
+        ngx_queue_remove(&seg->queue);
+        ctx->prefetch_n--;
+        ngx_http_nphase_seg_release(ctx, seg);
+        return;
+    }
+
+    seg->state = NGX_HTTP_NPHASE_SEG_FETCH;
+    ctx->hedge = seg;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "nphase hedge %O-%O: %V", seg->start, seg->end, &seg->loc);
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_hedge_done(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_uint_t error)
+{
+    ngx_http_nphase_seg_t           *seg;
+
+    /* the foreground subrequest r is done */
+
+    if (ctx->hedge_ev.timer_set) {
+        ngx_del_timer(&ctx->hedge_ev);
+    }
+
+    seg = ctx->hedge;
+
+    if (seg == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if ((!error && !ctx->hedge_won)
+        || seg->state == NGX_HTTP_NPHASE_SEG_ERROR)
+    {
+        ngx_http_nphase_hedge_stop(r->parent, ctx);
+        return NGX_DECLINED;
+    }
+
+    /* a prefetched segment now, the main loop promotes it */
+
+    ctx->hedge = NULL;
+    ctx->hedge_won = 0;
+    ctx->body_ready = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_hedge_stop(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_http_nphase_seg_t           *seg;
+
+    /* the foreground answered first, r is the main request */
+
+    if (ctx->hedge_ev.timer_set) {
+        ngx_del_timer(&ctx->hedge_ev);
+    }
+
+    seg = ctx->hedge;
+
+    if (seg == NULL) {
+        return;
+    }
+
+    ctx->hedge = NULL;
+    ctx->hedge_won = 0;
+
+    ngx_http_nphase_abort(seg->sr);
+    ngx_http_nphase_prefetch_discard(r, ctx, seg);
+}
+
+
+static void
+ngx_http_nphase_abort(ngx_http_request_t *sr)
+{
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_nphase_sub_ctx_t       *sr_ctx;
+
+    /*
+     * stop a subrequest that lost a race; this runs from the filters of
+     * another subrequest, so the work is done by a posted event
+     */
+
+    if (sr == NULL || sr->upstream == NULL || sr->done) {
+        return;
+    }
+
+    sr_ctx = ngx_http_get_module_ctx(sr, ngx_http_nphase_module);
+
+    if (sr_ctx == NULL || sr_ctx->aborted) {
+        return;
+    }
+
+    /* the request may go away before the posted event runs */
+
+    cln = ngx_pool_cleanup_add(sr->pool, 0);
+    if (cln == NULL) {
+        return;
+    }
+
+    cln->handler = ngx_http_nphase_abort_cleanup;
+    cln->data = &sr_ctx->abort_ev;
+
+    sr_ctx->aborted = 1;
+
+    sr_ctx->abort_ev.handler = ngx_http_nphase_abort_handler;
+    sr_ctx->abort_ev.data = sr;
+    sr_ctx->abort_ev.log = sr->connection->log;
+
+    ngx_post_event(&sr_ctx->abort_ev, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_nphase_abort_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c;
+    ngx_http_request_t              *sr;
+    ngx_http_upstream_t             *u;
+
+    sr = ev->data;
+    c = sr->connection;
+    u = sr->upstream;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "nphase abort subrequest \"%V\"", &sr->uri);
+
+    if (!sr->done && u->cleanup) {
+        /*
+         * what ngx_http_upstream_finalize_request() does to the upstream,
+         * without its ngx_http_finalize_request(sr, NGX_DONE): that one
+         * would take a reference of the main request in addition to the
+         * one below.  The peer is freed as not failed, the subrequest
+         * ends once with what it has passed on.
+         */
+
+        *u->cleanup = NULL;
+        u->cleanup = NULL;
+
+        if (u->resolved && u->resolved->ctx) {
+            ngx_resolve_name_done(u->resolved->ctx);
+            u->resolved->ctx = NULL;
+        }
+
+        if (u->peer.free && u->peer.sockaddr) {
+            u->peer.free(&u->peer, u->peer.data, 0);
+            u->peer.sockaddr = NULL;
+        }
+
+        if (u->peer.connection) {
+#if (NGX_HTTP_SSL)
+            if (u->peer.connection->ssl) {
+                u->peer.connection->ssl->no_wait_shutdown = 1;
+                (void) ngx_ssl_shutdown(u->peer.connection);
+            }
+#endif
+
+            if (u->peer.connection->pool) {
+                ngx_destroy_pool(u->peer.connection->pool);
+            }
+
+            ngx_close_connection(u->peer.connection);
+            u->peer.connection = NULL;
+        }
+
+        ngx_http_finalize_request(sr, NGX_OK);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_nphase_abort_cleanup(void *data)
+{
+    ngx_event_t  *ev = data;
+
+    if (ev->posted) {
+        ngx_delete_posted_event(ev);
+    }
+}
+
+
+static char *
+ngx_http_nphase_steal(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+
+    ssize_t                      size;
+    ngx_str_t                   *value, s;
+    ngx_uint_t                   i;
+
+    if (npcf->steal_rate != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        npcf->steal_rate = 0;
+        return NGX_CONF_OK;
+    }
+
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size == 0) {
+        i = 1;
+        goto invalid;
+    }
+
+    npcf->steal_rate = (size_t) size;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0) {
+                goto invalid;
+            }
+
+            npcf->steal_min = (size_t) size;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+static void
+ngx_http_nphase_steal_check(ngx_http_request_t *r,
+    ngx_http_nphase_ctx_t *ctx, ngx_http_nphase_sub_ctx_t *sr_ctx)
+{
+    u_char                          *p;
+    off_t                            rate, pos, left;
+    ngx_str_t                        loc;
+    ngx_msec_t                       elapsed;
+    ngx_http_nphase_conf_t          *npcf;
+    ngx_http_nphase_seg_t           *seg;
+
+    /* r is the foreground phase 2 subrequest */
+
+    npcf = ngx_http_get_module_loc_conf(r->main, ngx_http_nphase_module);
+
+    if (npcf->steal_rate == 0 || ctx->steal_cut || ctx->hedge) {
+        return;
+    }
+
+    if (ngx_http_nphase_over_budget(r, ctx)) {
+        /* the client is the slow side, a replica would not help */
+        return;
+    }
+
+    if (sr_ctx->rate_start == 0) {
+        sr_ctx->rate_start = ngx_current_msec;
+        sr_ctx->rate_received = sr_ctx->received;
+        return;
+    }
+
+    elapsed = ngx_current_msec - sr_ctx->rate_start;
+
+    if (elapsed < NGX_HTTP_NPHASE_STEAL_WINDOW) {
+        return;
+    }
+
+    rate = (sr_ctx->received - sr_ctx->rate_received) * 1000 / elapsed;
+
+    sr_ctx->rate_start = ngx_current_msec;
+    sr_ctx->rate_received = sr_ctx->received;
+
+    if (rate >= (off_t) npcf->steal_rate) {
+        return;
+    }
+
+    pos = ctx->fetch_start + ctx->fetch_skip + sr_ctx->received;
+    left = ctx->fetch_end - pos + 1;
+
+    if (left / 2 < (off_t) npcf->steal_min) {
+        return;
+    }
+
+    loc = ctx->loc_body_c;
+
+    if (ngx_http_nphase_extent_other(ctx, pos, &loc) != NGX_OK
+        && ngx_http_nphase_replica_next(ctx, &loc) != NGX_OK)
+    {
+        return;
+    }
+
+    seg = ngx_http_nphase_seg_alloc(r->parent, ctx);
+    if (seg == NULL) {
+        return;
+    }
+
+    p = ngx_http_nphase_reserve(r->parent->pool, &seg->loc_buf, loc.len);
+    if (p == NULL) {
+        ngx_queue_insert_head(&ctx->seg_free, &seg->queue);
+        return;
+    }
+
+    /* the second half of what is left comes from the replica */
+
+    seg->loc.len = ngx_cpymem(p, loc.data, loc.len) - p;
+    seg->loc.data = p;
+    seg->start = pos + left / 2;
+    seg->end = ctx->fetch_end;
+    seg->part = ctx->part;
+
+    ngx_queue_insert_head(&ctx->prefetch, &seg->queue);
+    ctx->prefetch_n++;
+
+    if (ngx_http_nphase_run_prefetch(r->parent, ctx, seg, 2) != NGX_OK) {
+        ngx_queue_remove(&seg->queue);
+        ctx->prefetch_n--;
+        ngx_http_nphase_seg_release(ctx, seg);
+        return;
+    }
+
+    seg->state = NGX_HTTP_NPHASE_SEG_FETCH;
+    ctx->steal_cut = seg->start - 1;
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "nphase %O bytes/s from \"%V\", %O-%O moved to \"%V\"",
+                  rate, &ctx->loc_body_c, seg->start, seg->end, &seg->loc);
+}
+
+
+static ngx_chain_t *
+ngx_http_nphase_steal_trim(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_sub_ctx_t *sr_ctx, ngx_chain_t *in)
+{
+    off_t                            left, size;
+    ngx_buf_t                       *b;
+    ngx_chain_t                     *cl, *out, **ll;
+
+    /* pass what is in front of the cut, drop the rest; NULL: nothing left */
+
+    left = ctx->steal_cut + 1
+           - (ctx->fetch_start + ctx->fetch_skip + sr_ctx->received);
+
+    out = NULL;
+    ll = &out;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+        size = ngx_buf_size(b);
+
+        if (left <= 0) {
+            b->pos = b->last;
+            b->file_pos = b->file_last;
+            continue;
+        }
+
+        if (size > left) {
+            if (ngx_buf_in_memory(b)) {
+                b->last = b->pos + (size_t) left;
+            }
+
+            if (b->in_file) {
+                b->file_last = b->file_pos + left;
+            }
+
+            size = left;
+        }
+
+        left -= size;
+
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    if (left <= 0 && !ctx->steal_abort) {
+        /* everything up to the cut is here, stop the slow server */
+        ctx->steal_abort = 1;
+        ngx_http_nphase_abort(r);
+    }
+
+    return out;
+}
+
+
+static ngx_chain_t *
+ngx_http_nphase_align_skip(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    off_t                            size;
+    ngx_buf_t                       *b;
+    ngx_chain_t                     *cl, *out, **ll;
+
+    /* drop the bytes in front of the client's range; NULL: nothing left */
+
+    out = NULL;
+    ll = &out;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+        size = ngx_min(ngx_buf_size(b), ctx->fetch_skip);
+
+        if (ngx_buf_in_memory(b)) {
+            b->pos += (size_t) size;
+        }
+
+        if (b->in_file) {
+            b->file_pos += size;
+        }
+
+        ctx->fetch_start += size;
+        ctx->fetch_skip -= size;
+
+        if (ngx_buf_size(b) == 0) {
+            continue;
+        }
+
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    return out;
+}
+
+
+static ngx_uint_t
+ngx_http_nphase_is_local(ngx_http_nphase_conf_t *npcf, ngx_str_t *loc)
+{
+    return npcf->local_root.len
+           && loc->len > sizeof("file://") - 1
+           && ngx_strncasecmp(loc->data, (u_char *) "file://",
+                              sizeof("file://") - 1)
+              == 0;
+}
+
+
+static ngx_uint_t
+ngx_http_nphase_over_budget(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    off_t                            size;
+    ngx_chain_t                     *cl;
+    ngx_http_nphase_conf_t          *npcf;
+    ngx_http_postponed_request_t    *pr;
+
+    r = r->main;
+
+    npcf = ngx_http_get_module_loc_conf(r, ngx_http_nphase_module);
+
+    if (npcf->buffers == 0) {
+        return 0;
+    }
+
+    /* memory the client has not taken yet, file buffers cost none */
+
+    size = ctx->prefetch_held;
+
+    for (cl = r->out; cl; cl = cl->next) {
+        if (ngx_buf_in_memory(cl->buf)) {
+            size += cl->buf->last - cl->buf->pos;
+        }
+    }
+
+    for (pr = r->postponed; pr; pr = pr->next) {
+        for (cl = pr->out; cl; cl = cl->next) {
+            if (ngx_buf_in_memory(cl->buf)) {
+                size += cl->buf->last - cl->buf->pos;
+            }
+        }
+    }
+
+    return size >= (off_t) npcf->buffers;
+}
+
+
+static void
+ngx_http_nphase_free_links(ngx_pool_t *pool, ngx_chain_t *in)
+{
+    ngx_chain_t                     *cl, *next;
+
+    /* back to the pool's free list, ngx_alloc_chain_link takes them again */
+
+    for (cl = in; cl; cl = next) {
+        next = cl->next;
+        ngx_free_chain(pool, cl);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_nphase_local_wait(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_connection_t                *c;
+    ngx_http_core_loc_conf_t        *clcf;
+
+    /*
+     * one file buffer of nphase_local_root at a time: the next segment
+     * is read once the client took the last one, this is woken up by
+     * the write event of the client connection
+     */
+
+    if (ctx->local_buf == NULL) {
+        return NGX_OK;
+    }
+
+    c = r->connection;
+
+    if (c->write->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        return NGX_ERROR;
+    }
+
+    if (ngx_buf_size(ctx->local_buf) || r->out) {
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_buf_size(ctx->local_buf) || r->out) {
+        if (!c->write->delayed) {
+            ngx_add_timer(c->write, clcf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    ctx->local_buf = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_run_local(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_conf_t *npcf)
+{
+    off_t                            start, end;
+    u_char                          *p, *last;
+    ngx_int_t                        rc;
+    ngx_str_t                        path;
+    ngx_buf_t                       *b;
+    ngx_pool_t                      *pool;
+    ngx_chain_t                      out;
+    ngx_open_file_info_t             of;
+    ngx_http_nphase_range_t         *rin;
+    ngx_http_core_loc_conf_t        *clcf;
+
+    /*
+     * file:///path is read from nphase_local_root/path at the offsets of
+     * the file, as a chunk server serving that file would answer
+     */
+
+    p = ctx->loc_body_c.data + sizeof("file://") - 1;
+    last = ctx->loc_body_c.data + ctx->loc_body_c.len;
+
+    if (*p != '/') {
+        goto unsafe;
+    }
+
+    for ( /* void */ ; p < last; p++) {
+        if (*p == '\0') {
+            goto unsafe;
+        }
+
+        if (*p == '/' && last - p >= 3 && p[1] == '.' && p[2] == '.'
+            && (last - p == 3 || p[3] == '/'))
+        {
+            goto unsafe;
+        }
+    }
+
+    p = ctx->loc_body_c.data + sizeof("file://") - 1;
+
+    rin = ngx_http_nphase_range_cur(ctx);
+
+    start = rin->start + ctx->range_sent.end;
+    end = ngx_http_nphase_range_next_end(ctx);
+
+    if (ctx->loc_end >= start && ctx->loc_end < end) {
+        end = ctx->loc_end;
+    }
+
+    path = ctx->local_file.name;
+
+    if (ctx->local_pool == NULL
+        || path.len != npcf->local_root.len + (last - p)
+        || ngx_strncmp(path.data + npcf->local_root.len, p, last - p) != 0)
+    {
+        /*
+         * one file open per request: the segments of a file read on from
+         * the same descriptor, another file closes it; the last buffer
+         * was sent already, see ngx_http_nphase_local_wait()
+         */
+
+        if (ctx->local_pool) {
+            ngx_destroy_pool(ctx->local_pool);
+            ctx->local_pool = NULL;
+        }
+
+        if (ngx_http_nphase_add_cleanup(r, ctx) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+        if (pool == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->local_pool = pool;
+
+        path.len = npcf->local_root.len + (last - p);
+        path.data = ngx_pnalloc(pool, path.len + 1);
+        if (path.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        *ngx_cpymem(ngx_cpymem(path.data, npcf->local_root.data,
+                               npcf->local_root.len),
+                    p, last - p)
+            = '\0';
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+        of.read_ahead = clcf->read_ahead;
+        of.directio = clcf->directio;
+        of.valid = clcf->open_file_cache_valid;
+        of.min_uses = clcf->open_file_cache_min_uses;
+        of.errors = clcf->open_file_cache_errors;
+        of.events = clcf->open_file_cache_events;
+
+        if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* the descriptor is closed with the pool, or given back to the cache */
+
+        if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, pool)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, of.err,
+                          "nphase %s \"%s\" failed", of.failed, path.data);
+            goto close;
+        }
+
+        if (!of.is_file) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "nphase \"%s\" is not a file", path.data);
+            goto close;
+        }
+
+        ngx_memzero(&ctx->local_file, sizeof(ngx_file_t));
+
+        ctx->local_file.fd = of.fd;
+        ctx->local_file.name = path;
+        ctx->local_file.log = r->connection->log;
+        ctx->local_file.directio = of.is_directio;
+        ctx->local_size = of.size;
+    }
+
+    if (start >= ctx->local_size) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "nphase \"%s\" does not hold offset %O",
+                      path.data, start);
+        goto failed;
+    }
+
+    /* like a chunk server, send what the file holds of the range */
+
+    if (end >= ctx->local_size) {
+        end = ctx->local_size - 1;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase local: \"%s\" %O-%O", path.data, start, end);
+
+    if (!ctx->header_sent) {
+        ctx->pr_status = (rin->flag == -1) ? NGX_HTTP_OK
+                                           : NGX_HTTP_PARTIAL_CONTENT;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK) {
+            return rc;
+        }
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = &ctx->local_file;
+    b->file_pos = start;
+    b->file_last = end + 1;
+    b->in_file = 1;
+
+    ctx->local_buf = b;
+
+    out.buf = b;
+    out.next = NULL;
+
+    /* sendfile or the aio of this location, the writer keeps the rest */
+
+    if (ngx_http_output_filter(r, &out) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ctx->range_sent.end += end - start + 1;
+    ctx->sr_count_e = 0;
+    ctx->fetching = 1;
+    ctx->body_ready = 1;
+    ctx->sr_done = 1;
+
+    ngx_http_post_request(r, NULL);
+    return NGX_AGAIN;
+
+unsafe:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "nphase unsafe local location \"%V\"", &ctx->loc_body_c);
+    goto failed;
+
+close:
+
+    ngx_destroy_pool(ctx->local_pool);
+    ctx->local_pool = NULL;
+
+failed:
+
+    ctx->fetching = 1;
+    ctx->body_ready = 0;
+    ctx->sr_done = 1;
+
+    ngx_http_nphase_retry_next(r, ctx, &ctx->loc_body_c,
+                               NGX_HTTP_BAD_GATEWAY);
+
+    ngx_http_post_request(r, NULL);
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_nphase_reverse(u_char *p, u_char *last)
+{
+    u_char  c;
+
+    while (p < --last) {
+        c = *p;
+        *p++ = *last;
+        *last = c;
+    }
+}
+
+
+static char *
+ngx_http_nphase_balance(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+
+    ssize_t                      size;
+    ngx_int_t                    max_fails;
+    ngx_str_t                   *value, name, s;
+    ngx_msec_t                   fail_timeout;
+    ngx_uint_t                   i;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_http_nphase_balance_t   *bal;
+
+    if (npcf->balance_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        npcf->balance_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    size = 0;
+    max_fails = NGX_CONF_UNSET;
+    fail_timeout = NGX_CONF_UNSET_MSEC;
+    ngx_str_null(&name);
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+
+            if (name.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_fails=", 10) == 0) {
+            max_fails = ngx_atoi(value[i].data + 10, value[i].len - 10);
+            if (max_fails == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fail_timeout=", 13) == 0) {
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            fail_timeout = ngx_parse_time(&s, 0);
+            if (fail_timeout == (ngx_msec_t) NGX_ERROR || fail_timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_nphase_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data == NULL) {
+        bal = ngx_pcalloc(cf->pool, sizeof(ngx_http_nphase_balance_t));
+        if (bal == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        bal->max_fails = NGX_HTTP_NPHASE_MAX_FAILS;
+        bal->fail_timeout = NGX_HTTP_NPHASE_FAIL_TIMEOUT;
+
+        shm_zone->init = ngx_http_nphase_balance_init_zone;
+        shm_zone->data = bal;
+
+    } else if (shm_zone->init != ngx_http_nphase_balance_init_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by "
+                           "nphase_location_cache", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the breaker belongs to the zone, where it is set last wins */
+
+    bal = shm_zone->data;
+
+    if (max_fails != NGX_CONF_UNSET) {
+        bal->max_fails = max_fails;
+    }
+
+    if (fail_timeout != NGX_CONF_UNSET_MSEC) {
+        bal->fail_timeout = fail_timeout;
+    }
+
+    npcf->balance_zone = shm_zone;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_balance_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_nphase_balance_t    *obal = data;
+
+    size_t                        len;
+    ngx_http_nphase_balance_t    *bal;
+
+    bal = shm_zone->data;
+
+    if (obal) {
+        bal->sh = obal->sh;
+        bal->shpool = obal->shpool;
+        return NGX_OK;
+    }
+
+    bal->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        bal->sh = bal->shpool->data;
+        return NGX_OK;
+    }
+
+    bal->sh = ngx_slab_alloc(bal->shpool,
+                             sizeof(ngx_http_nphase_balance_sh_t));
+    if (bal->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    bal->shpool->data = bal->sh;
+
+    ngx_rbtree_init(&bal->sh->rbtree, &bal->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&bal->sh->queue);
+
+    len = sizeof(" in nphase balance zone \"\"") + shm_zone->shm.name.len;
+
+    bal->shpool->log_ctx = ngx_slab_alloc(bal->shpool, len);
+    if (bal->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(bal->shpool->log_ctx, " in nphase balance zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_nphase_balance_node_t *
+ngx_http_nphase_balance_node(ngx_http_nphase_balance_t *bal, ngx_str_t *loc,
+    ngx_uint_t create)
+{
+    size_t                           size;
+    uint32_t                         hash;
+    ngx_str_t                        host;
+    ngx_uint_t                       n;
+    ngx_queue_t                     *q;
+    ngx_str_node_t                  *sn;
+    ngx_http_nphase_balance_node_t  *bn, *old;
+
+    /* called with the zone locked */
+
+    ngx_http_nphase_loc_host(loc, &host);
+
+    hash = ngx_crc32_short(host.data, host.len);
+
+    sn = ngx_str_rbtree_lookup(&bal->sh->rbtree, &host, hash);
+
+    if (sn) {
+        bn = (ngx_http_nphase_balance_node_t *) sn;
+
+        ngx_queue_remove(&bn->queue);
+        ngx_queue_insert_head(&bal->sh->queue, &bn->queue);
+
+        return bn;
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    size = offsetof(ngx_http_nphase_balance_node_t, data) + host.len;
+
+    bn = ngx_slab_alloc_locked(bal->shpool, size);
+
+    /* forget idle chunk servers not seen for the longest time */
+
+    for (n = 0; bn == NULL && n < 8; n++) {
+        if (ngx_queue_empty(&bal->sh->queue)) {
+            return NULL;
+        }
+
+        q = ngx_queue_last(&bal->sh->queue);
+        old = ngx_queue_data(q, ngx_http_nphase_balance_node_t, queue);
+
+        ngx_queue_remove(q);
+
+        if (old->inflight || !ngx_queue_empty(&old->waiters)) {
+            ngx_queue_insert_head(&bal->sh->queue, q);
+            continue;
+        }
+
+        ngx_rbtree_delete(&bal->sh->rbtree, &old->sn.node);
+        ngx_slab_free_locked(bal->shpool, old);
+
+        bn = ngx_slab_alloc_locked(bal->shpool, size);
+    }
+
+    if (bn == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(bn->data, host.data, host.len);
+
+    bn->sn.node.key = hash;
+    bn->sn.str.len = host.len;
+    bn->sn.str.data = bn->data;
+    bn->latency = 0;
+    bn->inflight = 0;
+    bn->fails = 0;
+    bn->failed = 0;
+    bn->opened = 0;
+    bn->probe = 0;
+    ngx_queue_init(&bn->waiters);
+
+    ngx_rbtree_insert(&bal->sh->rbtree, &bn->sn.node);
+    ngx_queue_insert_head(&bal->sh->queue, &bn->queue);
+
+    return bn;
+}
+
+
+static ngx_uint_t
+ngx_http_nphase_balance_cost(ngx_http_nphase_ctx_t *ctx, ngx_str_t *loc)
+{
+    ngx_uint_t                       cost;
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    /*
+     * expected wait: latency times the queue in front of us, raised by
+     * recent failures; a chunk server never seen costs nothing, so it
+     * gets tried. An open breaker is down until fail_timeout passed,
+     * then one subrequest may probe it (half open). A probe that has
+     * not ended within fail_timeout, its request went away, lets the
+     * next one try.
+     */
+
+    bal = ctx->balance;
+
+    if (bal == NULL) {
+        return 0;
+    }
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    bn = ngx_http_nphase_balance_node(bal, loc, 0);
+
+    if (bn == NULL) {
+        cost = 0;
+
+    } else if (bal->max_fails && bn->failed >= bal->max_fails
+               && (ngx_current_msec - bn->opened < bal->fail_timeout
+                   || (bn->probe
+                       && ngx_current_msec - bn->probe < bal->fail_timeout)))
+    {
+        cost = NGX_HTTP_NPHASE_BALANCE_DOWN;
+
+    } else {
+        cost = (bn->latency + NGX_HTTP_NPHASE_BALANCE_SCALE)
+               * (bn->inflight + 1) * (1000 + 4 * bn->fails) / 1000;
+    }
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+
+    return cost;
+}
+
+
+static void
+ngx_http_nphase_balance_begin(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_sub_ctx_t *sr_ctx)
+{
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    /*
+     * a phase 2 subrequest to the chunk server of sr_ctx->uri starts,
+     * its slot is reserved already
+     */
+
+    bal = ctx->balance;
+
+    if (bal == NULL || sr_ctx->uri.len == 0) {
+        return;
+    }
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    bn = ngx_http_nphase_balance_node(bal, &sr_ctx->uri, 1);
+
+    if (bn) {
+        sr_ctx->balanced = 1;
+        sr_ctx->balance_start = ngx_current_msec;
+
+        if (bal->max_fails && bn->failed >= bal->max_fails
+            && (bn->probe == 0
+                || ngx_current_msec - bn->probe >= bal->fail_timeout))
+        {
+            /* the one subrequest that tests a half open breaker */
+            bn->probe = ngx_current_msec ? ngx_current_msec : 1;
+            sr_ctx->balance_probe = 1;
+        }
+    }
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+}
+
+
+static void
+ngx_http_nphase_balance_header(ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_sub_ctx_t *sr_ctx)
+{
+    ngx_int_t                        sample;
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    bal = ctx->balance;
+
+    if (bal == NULL || !sr_ctx->balanced || sr_ctx->balance_header) {
+        return;
+    }
+
+    sr_ctx->balance_header = 1;
+
+    sample = (ngx_int_t) (ngx_current_msec - sr_ctx->balance_start)
+             * NGX_HTTP_NPHASE_BALANCE_SCALE;
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    bn = ngx_http_nphase_balance_node(bal, &sr_ctx->uri, 0);
+
+    if (bn) {
+        bn->latency += (sample - (ngx_int_t) bn->latency)
+                       / (1 << NGX_HTTP_NPHASE_BALANCE_SHIFT);
+    }
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+}
+
+
+static void
+ngx_http_nphase_balance_end(ngx_log_t *log, ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_sub_ctx_t *sr_ctx, ngx_uint_t error)
+{
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    bal = ctx->balance;
+
+    if (bal == NULL || !sr_ctx->balanced) {
+        return;
+    }
+
+    /* no headers at all counts the whole wait as latency */
+    ngx_http_nphase_balance_header(ctx, sr_ctx);
+
+    sr_ctx->balanced = 0;
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    bn = ngx_http_nphase_balance_node(bal, &sr_ctx->uri, 0);
+
+    if (bn) {
+        if (bn->inflight) {
+            bn->inflight--;
+        }
+
+        ngx_http_nphase_balance_grant(bn);
+
+        bn->fails -= bn->fails >> NGX_HTTP_NPHASE_BALANCE_SHIFT;
+
+        if (sr_ctx->balance_probe) {
+            bn->probe = 0;
+        }
+
+        if (error) {
+            bn->fails += 1000 >> NGX_HTTP_NPHASE_BALANCE_SHIFT;
+            bn->failed++;
+
+            if (bal->max_fails && bn->failed >= bal->max_fails) {
+                /* open, or open again after a failed probe */
+                bn->opened = ngx_current_msec;
+
+                if (bn->failed == bal->max_fails) {
+                    ngx_log_error(NGX_LOG_WARN, log, 0,
+                                  "nphase chunk server \"%V\" is down",
+                                  &bn->sn.str);
+                }
+            }
+
+        } else if (sr_ctx->done) {
+            /* not when the request went away before the answer */
+
+            if (bal->max_fails && bn->failed >= bal->max_fails) {
+                ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                              "nphase chunk server \"%V\" is up again",
+                              &bn->sn.str);
+            }
+
+            bn->failed = 0;
+        }
+    }
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+}
+
+
+static char *
+ngx_http_nphase_max_conns(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_nphase_conf_t      *npcf = conf;
+
+    ngx_int_t                    n;
+    ngx_str_t                   *value, s;
+    ngx_msec_t                   timeout;
+    ngx_uint_t                   i;
+
+    if (npcf->max_conns != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR) {
+        i = 1;
+        goto invalid;
+    }
+
+    npcf->max_conns = n;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "queue_timeout=", 14) == 0) {
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            npcf->queue_timeout = timeout;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_admit(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_conf_t *npcf)
+{
+    off_t                            offset;
+    ngx_str_t                        loc;
+    ngx_int_t                        rc;
+
+    /*
+     * a free connection to the chunk server of loc_body_c, or wait for
+     * one; after queue_timeout another replica is waited for once, then
+     * the limit is passed
+     */
+
+    if (ctx->reserved) {
+        return NGX_OK;
+    }
+
+    /* leaves the line when the request goes away */
+
+    if (ngx_http_nphase_add_cleanup(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        rc = ngx_http_nphase_balance_wait(ctx, &ctx->loc_body_c,
+                                          npcf->max_conns,
+                                          npcf->queue_timeout);
+
+        if (rc != NGX_BUSY) {
+            ctx->reserved = (rc == NGX_OK);
+            ctx->queued = 0;
+            ctx->queue_switched = 0;
+            return NGX_OK;
+        }
+
+        if (!ctx->queued) {
+            ctx->queued = 1;
+            ctx->queue_start = ngx_current_msec;
+        }
+
+        if (ngx_current_msec - ctx->queue_start < npcf->queue_timeout) {
+            break;
+        }
+
+        if (ngx_http_nphase_balance_unwait(ctx) == NGX_OK) {
+            /* a slot came with the timeout */
+            ctx->reserved = 1;
+            ctx->queued = 0;
+            ctx->queue_switched = 0;
+            return NGX_OK;
+        }
+
+        loc = ctx->loc_body_c;
+        offset = ngx_http_nphase_range_cur(ctx)->start + ctx->range_sent.end;
+
+        if (ctx->queue_switched
+            || (ngx_http_nphase_extent_other(ctx, offset, &loc) != NGX_OK
+                && ngx_http_nphase_replica_next(ctx, &loc) != NGX_OK))
+        {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "nphase no free connection to \"%V\" after %M ms",
+                          &ctx->loc_body_c,
+                          ngx_current_msec - ctx->queue_start);
+
+            if (ngx_http_nphase_balance_reserve(ctx, &ctx->loc_body_c, 0)
+                == NGX_OK)
+            {
+                ctx->reserved = 1;
+            }
+
+            ctx->queued = 0;
+            ctx->queue_switched = 0;
+            return NGX_OK;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "nphase queue: \"%V\" busy, waiting for \"%V\"",
+                       &ctx->loc_body_c, &loc);
+
+        ctx->loc_body_c = loc;
+        ctx->queue_start = ngx_current_msec;
+        ctx->queue_switched = 1;
+    }
+
+    ctx->queue_ev.handler = ngx_http_nphase_queue_handler;
+    ctx->queue_ev.data = r;
+    ctx->queue_ev.log = r->connection->log;
+
+    /* woken up by ngx_http_nphase_wait_handler when a slot is free */
+
+    if (!ctx->queue_ev.timer_set) {
+        ngx_add_timer(&ctx->queue_ev, npcf->queue_timeout
+                                      - (ngx_current_msec - ctx->queue_start));
+    }
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_nphase_queue_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t              *r;
+
+    r = ev->data;
+
+    /* queue_timeout */
+
+    ngx_http_post_request(r, NULL);
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_balance_wait(ngx_http_nphase_ctx_t *ctx, ngx_str_t *loc,
+    ngx_uint_t max, ngx_msec_t timeout)
+{
+    ngx_int_t                        rc;
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_wait_t  *w;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    /*
+     * a slot to the chunk server of loc, or a place in its line;
+     * NGX_BUSY: in line, the worker is woken up when it is its turn
+     */
+
+    bal = ctx->balance;
+
+    if (bal == NULL || loc->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    w = ctx->wait;
+
+    if (w) {
+        if (w->granted) {
+            ngx_slab_free_locked(bal->shpool, w);
+            ctx->wait = NULL;
+            ngx_queue_remove(&ctx->wait_queue);
+            rc = NGX_OK;
+
+        } else {
+            rc = NGX_BUSY;
+        }
+
+        goto done;
+    }
+
+    bn = ngx_http_nphase_balance_node(bal, loc, 1);
+
+    if (bn == NULL) {
+        rc = NGX_DECLINED;
+        goto done;
+    }
+
+    if (max == 0
+        || (bn->inflight < max && ngx_queue_empty(&bn->waiters)))
+    {
+        bn->inflight++;
+        rc = NGX_OK;
+        goto done;
+    }
+
+    w = ngx_slab_alloc_locked(bal->shpool,
+                              sizeof(ngx_http_nphase_balance_wait_t));
+    if (w == NULL) {
+        /* no room to wait in, the limit is passed */
+        rc = NGX_DECLINED;
+        goto done;
+    }
+
+    w->pid = ngx_pid;
+    w->max = max;
+    w->expire = ngx_current_msec + timeout + NGX_HTTP_NPHASE_QUEUE_GRACE;
+    w->granted = 0;
+
+    ngx_queue_insert_tail(&bn->waiters, &w->queue);
+
+    ctx->wait = w;
+    ngx_queue_insert_tail(&ngx_http_nphase_waiting, &ctx->wait_queue);
+
+    if (!ngx_http_nphase_wait_ev.timer_set) {
+        ngx_add_timer(&ngx_http_nphase_wait_ev, NGX_HTTP_NPHASE_QUEUE_POLL);
+    }
+
+    rc = NGX_BUSY;
+
+done:
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_balance_unwait(ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_int_t                        rc;
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_wait_t  *w;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    /* leaves the line; NGX_OK: the slot was given meanwhile, keep it */
+
+    w = ctx->wait;
+
+    if (w == NULL) {
+        return NGX_DECLINED;
+    }
+
+    bal = ctx->balance;
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    if (w->granted) {
+        rc = NGX_OK;
+
+    } else {
+        ngx_queue_remove(&w->queue);
+        rc = NGX_DECLINED;
+
+        /* the next ones may fit under a higher limit */
+
+        bn = ngx_http_nphase_balance_node(bal, &ctx->loc_body_c, 0);
+
+        if (bn) {
+            ngx_http_nphase_balance_grant(bn);
+        }
+    }
+
+    ngx_slab_free_locked(bal->shpool, w);
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+
+    ctx->wait = NULL;
+    ngx_queue_remove(&ctx->wait_queue);
+
+    return rc;
+}
+
+
+static void
+ngx_http_nphase_wait_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                       granted;
+    ngx_queue_t                     *q, *next, woken;
+    ngx_http_request_t              *r;
+    ngx_http_nphase_ctx_t           *ctx;
+    ngx_http_nphase_balance_t       *bal;
+
+    /*
+     * wakes the requests of this worker whose turn came, slots freed
+     * in other workers are seen here on the next tick
+     */
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ngx_queue_init(&woken);
+
+    for (q = ngx_queue_head(&ngx_http_nphase_waiting);
+         q != ngx_queue_sentinel(&ngx_http_nphase_waiting);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        ctx = ngx_queue_data(q, ngx_http_nphase_ctx_t, wait_queue);
+        bal = ctx->balance;
+
+        ngx_shmtx_lock(&bal->shpool->mutex);
+        granted = ctx->wait->granted;
+        ngx_shmtx_unlock(&bal->shpool->mutex);
+
+        if (granted) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_tail(&woken, q);
+        }
+    }
+
+    /* in the order of the line, ngx_http_nphase_admit() takes the slot */
+
+    while (!ngx_queue_empty(&woken)) {
+        q = ngx_queue_head(&woken);
+        ngx_queue_remove(q);
+        ngx_queue_init(q);
+
+        ctx = ngx_queue_data(q, ngx_http_nphase_ctx_t, wait_queue);
+
+        if (ctx->queue_ev.timer_set) {
+            ngx_del_timer(&ctx->queue_ev);
+        }
+
+        r = ctx->queue_ev.data;
+
+        ngx_http_post_request(r, NULL);
+        ngx_http_run_posted_requests(r->connection);
+    }
+
+    if (!ngx_queue_empty(&ngx_http_nphase_waiting)) {
+        ngx_add_timer(ev, NGX_HTTP_NPHASE_QUEUE_POLL);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_nphase_init_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_init(&ngx_http_nphase_waiting);
+
+    ngx_http_nphase_wait_ev.handler = ngx_http_nphase_wait_handler;
+    ngx_http_nphase_wait_ev.log = cycle->log;
+    ngx_http_nphase_wait_ev.cancelable = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_balance_reserve(ngx_http_nphase_ctx_t *ctx, ngx_str_t *loc,
+    ngx_uint_t max)
+{
+    ngx_int_t                        rc;
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    /* count a phase 2 subrequest in flight, NGX_BUSY: max reached */
+
+    bal = ctx->balance;
+
+    if (bal == NULL || loc->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    bn = ngx_http_nphase_balance_node(bal, loc, 1);
+
+    if (bn == NULL) {
+        rc = NGX_DECLINED;
+
+    } else if (max
+               && (bn->inflight >= max || !ngx_queue_empty(&bn->waiters)))
+    {
+        /* not ahead of the requests in line */
+        rc = NGX_BUSY;
+
+    } else {
+        bn->inflight++;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+
+    return rc;
+}
+
+
+static void
+ngx_http_nphase_balance_release(ngx_http_nphase_ctx_t *ctx, ngx_str_t *loc)
+{
+    ngx_http_nphase_balance_t       *bal;
+    ngx_http_nphase_balance_node_t  *bn;
+
+    bal = ctx->balance;
+
+    if (bal == NULL) {
+        return;
+    }
+
+    ngx_shmtx_lock(&bal->shpool->mutex);
+
+    bn = ngx_http_nphase_balance_node(bal, loc, 0);
+
+    if (bn) {
+        if (bn->inflight) {
+            bn->inflight--;
+        }
+
+        ngx_http_nphase_balance_grant(bn);
+    }
+
+    ngx_shmtx_unlock(&bal->shpool->mutex);
+}
+
+
+static void
+ngx_http_nphase_balance_grant(ngx_http_nphase_balance_node_t *bn)
+{
+    ngx_queue_t                     *q;
+    ngx_http_nphase_balance_wait_t  *w;
+
+    /*
+     * called with the zone locked: free slots go to the waiters in the
+     * order they came, a waiter whose worker let it expire is dropped
+     */
+
+    while (!ngx_queue_empty(&bn->waiters)) {
+        q = ngx_queue_head(&bn->waiters);
+        w = ngx_queue_data(q, ngx_http_nphase_balance_wait_t, queue);
+
+        if ((ngx_msec_int_t) (ngx_current_msec - w->expire) > 0) {
+            ngx_queue_remove(q);
+            ngx_queue_init(q);
+            continue;
+        }
+
+        if (w->max && bn->inflight >= w->max) {
+            break;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_init(q);
+
+        bn->inflight++;
+        w->granted = 1;
+
+        if (w->pid == ngx_pid && !ngx_http_nphase_wait_ev.posted) {
+            /* freed in the worker of the waiter, wake it at once */
+            ngx_post_event(&ngx_http_nphase_wait_ev, &ngx_posted_events);
+        }
+    }
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_nphase_loc_cache_alloc(ngx_http_nphase_loc_cache_t *cache,
+    size_t size)
+{
+    ngx_rbtree_node_t            *node;
+
+    /* called with the zone locked */
+
+    ngx_http_nphase_loc_cache_expire(cache, 0);
+
+    node = ngx_slab_alloc_locked(cache->shpool, size);
+
+    if (node == NULL) {
+        ngx_http_nphase_loc_cache_expire(cache, 1);
+
+        node = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+
+    return node;
+}
+
+
+static ngx_int_t
+ngx_http_nphase_loc_cache_lock(ngx_http_request_t *r,
+    ngx_http_nphase_conf_t *npcf, ngx_http_nphase_ctx_t *ctx)
+{
+    size_t                        size;
+    uint32_t                      hash;
+    ngx_str_t                    *key;
+    ngx_rbtree_node_t            *node;
+    ngx_http_nphase_loc_node_t   *lcn;
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    /*
+     * a location without a location: the phase 1 of this request is the
+     * one for its key, others wait for it instead of asking too; the key
+     * holds the host and the metadata uri, see loc_cache_key().
+     * NGX_BUSY: someone else asks, or has just stored the answer.
+     */
+
+    key = &ctx->loc_key;
+
+    if (npcf->loc_cache_zone == NULL
+        || npcf->loc_cache_lock == 0
+        || key->len == 0
+        || ctx->loc_locked)
+    {
+        return NGX_OK;
+    }
+
+    cache = npcf->loc_cache_zone->data;
+    hash = ngx_crc32_short(key->data, key->len);
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_nphase_loc_node_t, data)
+           + key->len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    lcn = ngx_http_nphase_loc_cache_find(cache, key, hash);
+
+    if (lcn) {
+        if (lcn->expire > ngx_time()) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_BUSY;
+        }
+
+        /* the lock timed out, this request asks now */
+        ngx_http_nphase_loc_cache_remove(cache, lcn);
+    }
+
+    node = ngx_http_nphase_loc_cache_alloc(cache, size);
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_OK;
+    }
+
+    node->key = hash;
+
+    lcn = (ngx_http_nphase_loc_node_t *) &node->color;
+
+    lcn->len = (u_short) key->len;
+    lcn->loc_len = 0;
+    lcn->status = 0;
+    lcn->expire = ngx_time() + npcf->loc_cache_lock;
+    lcn->wfsz = 0;
+
+    ngx_memcpy(lcn->data, key->data, key->len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &lcn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ctx->loc_locked = 1;
+    ctx->loc_zone = npcf->loc_cache_zone;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "nphase location cache lock: \"%V\"", key);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_nphase_loc_cache_unlock(ngx_log_t *log, ngx_http_nphase_ctx_t *ctx)
+{
+    ngx_http_nphase_loc_cache_t  *cache;
+
+    /*
+     * phase 1 gave no location to store, let the next one ask; the zone
+     * is the one locked in, the request may be in another location now
+     */
+
+    if (ctx == NULL || !ctx->loc_locked) {
+        return;
+    }
+
+    ctx->loc_locked = 0;
+
+    cache = ctx->loc_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_nphase_loc_cache_drop(cache, &ctx->loc_key);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "nphase location cache unlock: \"%V\"", &ctx->loc_key);
+}
+
+
+static ngx_int_t
+ngx_http_nphase_run_lookup(ngx_http_request_t *r, ngx_http_nphase_ctx_t *ctx,
+    ngx_http_nphase_conf_t *npcf)
+{
+    /* phase 1, unless the same lookup is already running */
+
+    if (ngx_http_nphase_loc_cache_lock(r, npcf, ctx) == NGX_BUSY) {
+
+        if (ngx_http_nphase_add_cleanup(r, ctx) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "nphase location cache wait: \"%V\"", &ctx->loc_key);
+
+        ctx->loc_waiting = 1;
+
+        ctx->loc_ev.handler = ngx_http_nphase_loc_wait_handler;
+        ctx->loc_ev.data = r;
+        ctx->loc_ev.log = r->connection->log;
+
+        ngx_add_timer(&ctx->loc_ev, NGX_HTTP_NPHASE_QUEUE_POLL);
+
+        return NGX_AGAIN;
+    }
+
+    ctx->fetching = 0;
+
+    if (ngx_http_nphase_run_subrequest(r, ctx, &npcf->uri, NULL) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_nphase_loc_wait_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t              *r;
+
+    r = ev->data;
+
+    /* the lock holder may be in another worker, look again */
+
+    ngx_http_post_request(r, NULL);
+    ngx_http_run_posted_requests(r->connection);
+}